@@ -17,17 +17,23 @@
 
 #include <QCoreApplication>
 #include <QFile>
+#include <QRunnable>
 #include <QStringList>
 #include <QTextStream>
+#include <QThreadPool>
 #include <QDebug>
 
 #include <limits.h>
 #include <stdio.h>
 
 #include "CommandLineParser.h"
+#include "metrics.h"
+#include "progress.h"
 #include "ruleparser.h"
 #include "repository.h"
+#include "status.h"
 #include "svn.h"
+#include "trace.h"
 
 QHash<QByteArray, QByteArray> loadIdentityMapFile(const QString &fileName)
 {
@@ -125,6 +131,30 @@ QSet<int> loadRevisionsFile( const QString &fileName, Svn &svn )
     return revisions;
 }
 
+// Brings a repository up to date on disk and loads its state from a
+// previous run; these don't depend on each other, so they run in parallel.
+// A reload only loads the history again, up to a lower cutoff.
+class RepositoryLoader : public QRunnable
+{
+public:
+    RepositoryLoader(Repository *r, int c) : repo(r), cutoff(c), next(0), loaded(false) { setAutoDelete(false); }
+    void run()
+    {
+        if (!loaded) {
+            repo->initialize();
+            repo->restoreAnnotatedTags();
+            repo->restoreBranchNotes();
+            loaded = true;
+        }
+        next = repo->setupIncremental(cutoff);
+    }
+
+    Repository * const repo;
+    int cutoff;
+    int next;
+    bool loaded;
+};
+
 static const CommandLineOption options[] = {
     {"--identity-map FILENAME", "provide map between svn username and email"},
     {"--identity-domain DOMAIN", "provide user domain if no map was given"},
@@ -140,11 +170,21 @@ static const CommandLineOption options[] = {
     {"--debug-rules", "print what rule is being used for each file"},
     {"--commit-interval NUMBER", "if passed the cache will be flushed to git every NUMBER of commits"},
     {"--stats", "after a run print some statistics about the rules"},
+    {"--rule-profile FILENAME", "try rules in the order of their match counts in FILENAME where that can't change the result, then save this run's counts to it"},
+    {"--metrics FILENAME", "write phase timings as JSON to FILENAME during and after the run"},
+    {"--slow-revisions NUMBER", "number of slowest revisions to report with --stats or --metrics, defaults to 10"},
+    {"--trace FILENAME", "write a Chrome trace of the work done per revision to FILENAME"},
+    {"--trace-sample NUMBER", "only trace every NUMBER-th revision, defaults to 1"},
+    {"--trace-buffer NUMBER", "keep only the last NUMBER spans of the trace, defaults to 1000000"},
+    {"--status-socket PATH", "answer status queries in JSON on a Unix domain socket at PATH"},
+    {"--progress-interval SECONDS", "seconds between progress reports, defaults to 1 on a terminal and 30 otherwise"},
     {"--svn-branches", "Use the contents of SVN when creating branches, Note: SVN tags are branches as well"},
     {"--empty-dirs", "Add .gitignore-file for empty dirs"},
     {"--svn-ignore", "Import svn-ignore-properties via .gitignore"},
     {"--propcheck", "Check for svn-properties except svn-ignore"},
     {"--fast-import-timeout SECONDS", "number of seconds to wait before terminating fast-import, 0 to wait forever"},
+    {"--fast-init", "create new repositories directly instead of running git init"},
+    {"--threads NUMBER", "number of threads to use, defaults to the number of CPUs"},
     {"-h, --help", "show help"},
     {"-v, --version", "show version"},
     CommandLineLastOption
@@ -159,6 +199,10 @@ int main(int argc, char **argv)
     CommandLineParser::init(argc, argv);
     CommandLineParser::addOptionDefinitions(options);
     Stats::init();
+    Progress::init();
+    Metrics::init();
+    Trace::init();
+    Status::init();
     CommandLineParser *args = CommandLineParser::instance();
     if(args->contains(QLatin1String("version"))) {
         printf("Git version: %s\n", VER);
@@ -191,9 +235,14 @@ int main(int argc, char **argv)
     }
 
     QCoreApplication app(argc, argv);
+    if (args->contains("threads"))
+        QThreadPool::globalInstance()->setMaxThreadCount(qMax(1, args->optionArgument("threads").toInt()));
+
     // Load the configuration
     RulesList rulesList(args->optionArgument(QLatin1String("rules")));
     rulesList.load();
+    if (args->contains("rule-profile"))
+        rulesList.reorderMatchRules(Stats::loadProfile(args->optionArgument("rule-profile")));
 
     int resume_from = args->optionArgument(QLatin1String("resume-from")).toInt();
     int max_rev = args->optionArgument(QLatin1String("max-rev")).toInt();
@@ -202,41 +251,61 @@ int main(int argc, char **argv)
     QHash<QString, Repository *> repositories;
 
     int cutoff = resume_from ? resume_from : INT_MAX;
- retry:
     int min_rev = 1;
+    QList<RepositoryLoader *> loaders;
     foreach (Rules::Repository rule, rulesList.allRepositories()) {
         Repository *repo = createRepository(rule, repositories);
         if (!repo)
             return EXIT_FAILURE;
         repositories.insert(rule.name, repo);
 
-        int repo_next = repo->setupIncremental(cutoff);
-        repo->restoreAnnotatedTags();
-        repo->restoreBranchNotes();
+        RepositoryLoader *loader = new RepositoryLoader(repo, cutoff);
+        loaders.append(loader);
+        QThreadPool::globalInstance()->start(loader);
+    }
+    QThreadPool::globalInstance()->waitForDone();
+
+    forever {
+        min_rev = 1;
+        int new_cutoff = cutoff;
+        foreach (RepositoryLoader *loader, loaders) {
+            if (min_rev < loader->next)
+                min_rev = loader->next;
+            if (loader->cutoff < new_cutoff)
+                new_cutoff = loader->cutoff;
+        }
+        if (new_cutoff == cutoff)
+            break;
+
+        /*
+  * Some repository rewound to an earlier revision.  Load the
+  * history of those that got past it again, up to that one, as
+  * if the lower cutoff had been known from the start.  (since
+  * cutoff is decreasing, we're sure we'll make forward progress
+  * eventually)
+  */
+        cutoff = new_cutoff;
+        foreach (RepositoryLoader *loader, loaders) {
+            loader->cutoff = cutoff;
+            if (loader->next > cutoff)
+                QThreadPool::globalInstance()->start(loader);
+        }
+        QThreadPool::globalInstance()->waitForDone();
+    }
 
+    foreach (RepositoryLoader *loader, loaders) {
         /*
   * cutoff < resume_from => error exit eventually
   * repo_next == cutoff => probably truncated log
   */
-        if (cutoff < resume_from && repo_next == cutoff)
+        if (cutoff < resume_from && loader->next == cutoff)
             /*
       * Restore the log file so we fail the next time
       * svn2git is invoked with the same arguments
       */
-            repo->restoreLog();
-
-        if (cutoff < min_rev)
-            /*
-      * We've rewound before the last revision of some
-      * repository that we've already seen.  Start over
-      * from the beginning.  (since cutoff is decreasing,
-      * we're sure we'll make forward progress eventually)
-      */
-            goto retry;
-
-        if (min_rev < repo_next)
-            min_rev = repo_next;
+            loader->repo->restoreLog();
     }
+    qDeleteAll(loaders);
 
     if (cutoff < resume_from) {
         qCritical() << "Cannot resume from" << resume_from
@@ -263,30 +332,50 @@ int main(int argc, char **argv)
 
     if (max_rev < 1)
         max_rev = svn.youngestRevision();
+    if (svn.lastExportRevision() < max_rev) {
+        max_rev = svn.lastExportRevision();
+        qDebug() << "no rule can export anything after revision" << max_rev << ", stopping there";
+    }
 
     bool errors = false;
+    Progress::instance()->setRevisionRange(min_rev, max_rev);
+    Stats::instance()->setRevisionRange(min_rev, max_rev);
+    Status::instance()->start();
     QSet<int> revisions = loadRevisionsFile(args->optionArgument(QLatin1String("revisions-file")), svn);
     const bool filerRevisions = !revisions.isEmpty();
+    if (filerRevisions) {
+        // the ETA counts the revisions left to export, not the span of their numbers
+        int count = 0;
+        foreach (int rev, revisions)
+            if (rev >= min_rev && rev <= max_rev)
+                ++count;
+        Progress::instance()->setRevisionCount(count);
+    }
     for (int i = min_rev; i <= max_rev; ++i) {
-        if(filerRevisions) {
-            if( !revisions.contains(i) ) {
-                printf(".");
-                continue;
-            } else {
-                printf("\n");
-            }
-        }
+        if(filerRevisions && !revisions.contains(i))
+            continue;
         if (!svn.exportRevision(i)) {
             errors = true;
             break;
         }
+        Metrics::instance()->tick();
+        Status::instance()->update();
     }
+    Progress::instance()->finish();
 
     foreach (Repository *repo, repositories) {
         repo->finalizeTags();
         repo->saveBranchNotes();
-        delete repo;
     }
+    closeFastImports();
+    Status::instance()->stop();
+    foreach (Repository *repo, repositories)
+        repo->printStats();
+    qDeleteAll(repositories);
     Stats::instance()->printStats();
+    if (args->contains("rule-profile"))
+        Stats::instance()->writeProfile(args->optionArgument("rule-profile"));
+    Metrics::instance()->finish();
+    Trace::instance()->finish();
     return errors ? EXIT_FAILURE : EXIT_SUCCESS;
 }
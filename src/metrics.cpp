@@ -0,0 +1,354 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "metrics.h"
+#include "progress.h"
+#include "repository.h"
+#include "ruleparser.h"
+#include "CommandLineParser.h"
+
+#include <QDebug>
+#include <QFile>
+#include <QMap>
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+// how often the --metrics file is rewritten during the run
+static const qint64 reportInterval = 60 * 1000;
+
+// bucket i counts revisions that took less than 2^i ms, the last one the rest
+static const int histogramBuckets = 22;
+
+static const char * const phaseNames[Metrics::PhaseCount] = {
+    "open_root",
+    "paths_changed",
+    "rule_matching",
+    "blob_read",
+    "fast_import_wait",
+    "msg_filter",
+    "checkpoint",
+    "process_start"
+};
+
+Metrics *Metrics::self = 0;
+
+class Metrics::Private
+{
+public:
+    struct Counter
+    {
+        Counter() : count(0), nsecs(0) {}
+        qint64 count;
+        qint64 nsecs;
+    };
+
+    struct Revision
+    {
+        int revnum;
+        qint64 nsecs;
+        int changedPaths;
+        int recursionDepth;
+        qint64 blobBytes;
+        qint64 phases[PhaseCount];
+    };
+
+    Private() : nextReport(reportInterval), slowCount(10)
+    {
+        memset(histogram, 0, sizeof histogram);
+    }
+
+    Counter phases[PhaseCount];
+    QMap<QString, Counter> stalls;
+
+    // the revision being exported, and the totals when it started
+    Revision current;
+    QElapsedTimer revisionClock;
+    qint64 revisionBytes;
+
+    int slowCount;
+    QList<Revision> slowest;            // slowest first
+    qint64 histogram[histogramBuckets];
+
+    QString fileName;
+    QElapsedTimer clock;
+    qint64 nextReport;
+};
+
+Metrics::Metrics() : d(new Private)
+{
+    d->fileName = CommandLineParser::instance()->optionArgument("metrics");
+    use = !d->fileName.isEmpty() || CommandLineParser::instance()->contains("stats")
+          || CommandLineParser::instance()->contains("status-socket");
+    if (CommandLineParser::instance()->contains("slow-revisions"))
+        d->slowCount = qMax(0, CommandLineParser::instance()->optionArgument("slow-revisions").toInt());
+    d->clock.start();
+}
+
+Metrics::~Metrics()
+{
+    delete d;
+}
+
+void Metrics::init()
+{
+    if(self)
+        delete self;
+    self = new Metrics();
+}
+
+Metrics *Metrics::instance()
+{
+    return self;
+}
+
+void Metrics::add(Phase phase, qint64 nsecs)
+{
+    Private::Counter &c = d->phases[phase];
+    ++c.count;
+    c.nsecs += nsecs;
+}
+
+void Metrics::addStall(const QString &repository, qint64 nsecs)
+{
+    if (!use)
+        return;
+    add(FastImportWait, nsecs);
+    Private::Counter &c = d->stalls[repository];
+    ++c.count;
+    c.nsecs += nsecs;
+}
+
+qint64 Metrics::total(Phase phase) const
+{
+    return d->phases[phase].nsecs;
+}
+
+// in bytes, from /proc where there is one
+qint64 Metrics::currentRss()
+{
+    QFile statm("/proc/self/statm");
+    if (!statm.open(QIODevice::ReadOnly))
+        return 0;
+    QList<QByteArray> fields = statm.readAll().split(' ');
+    if (fields.size() < 2)
+        return 0;
+    return fields.at(1).toLongLong() * sysconf(_SC_PAGESIZE);
+}
+
+qint64 Metrics::peakRss()
+{
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef Q_OS_MAC
+    return usage.ru_maxrss;             // bytes
+#else
+    return usage.ru_maxrss * 1024LL;    // kilobytes
+#endif
+}
+
+void Metrics::beginRevision(int revnum)
+{
+    if (!use)
+        return;
+    d->current.revnum = revnum;
+    for (int i = 0; i < PhaseCount; ++i)
+        d->current.phases[i] = d->phases[i].nsecs;
+    d->revisionBytes = Progress::instance()->bytesExported();
+    d->revisionClock.start();
+}
+
+void Metrics::endRevision(int changedPaths, int recursionDepth)
+{
+    if (!use)
+        return;
+    Private::Revision &rev = d->current;
+    rev.nsecs = d->revisionClock.nsecsElapsed();
+    rev.changedPaths = changedPaths;
+    rev.recursionDepth = recursionDepth;
+    rev.blobBytes = Progress::instance()->bytesExported() - d->revisionBytes;
+
+    int bucket = 0;
+    for (qint64 ms = rev.nsecs / 1000000; ms && bucket < histogramBuckets - 1; ms >>= 1)
+        ++bucket;
+    ++d->histogram[bucket];
+
+    QList<Private::Revision> &slowest = d->slowest;
+    if (slowest.size() < d->slowCount || (d->slowCount && rev.nsecs > slowest.last().nsecs)) {
+        for (int i = 0; i < PhaseCount; ++i)
+            rev.phases[i] = d->phases[i].nsecs - rev.phases[i];
+        int i = slowest.size();
+        while (i > 0 && slowest.at(i - 1).nsecs < rev.nsecs)
+            --i;
+        slowest.insert(i, rev);
+        if (slowest.size() > d->slowCount)
+            slowest.removeLast();
+    }
+}
+
+void Metrics::tick()
+{
+    if (d->fileName.isEmpty() || d->clock.elapsed() < d->nextReport)
+        return;
+    d->nextReport = d->clock.elapsed() + reportInterval;
+    writeReport(LiveReport);
+}
+
+void Metrics::finish()
+{
+    if (!d->fileName.isEmpty())
+        writeReport(FinalReport);
+    if (CommandLineParser::instance()->contains("stats")) {
+        printf("\nPhase timings\n%s", toJson(FinalReport).constData());
+        printf("\nSlowest revisions\n");
+        foreach (const Private::Revision &rev, d->slowest) {
+            printf("r%d: %.3f s, %d changed paths, recursion depth %d, %.2f MB of blobs\n",
+                   rev.revnum, rev.nsecs / 1e9, rev.changedPaths, rev.recursionDepth,
+                   rev.blobBytes / (1024.0 * 1024.0));
+            for (int i = 0; i < PhaseCount; ++i)
+                if (rev.phases[i])
+                    printf("    %-18s %10.3f s\n", phaseNames[i], rev.phases[i] / 1e9);
+        }
+    }
+    printf("Peak memory use: %.1f MB\n", peakRss() / (1024.0 * 1024.0));
+}
+
+void Metrics::writeReport(Report report)
+{
+    // write next to the report and rename, so a reader never sees half a file
+    QString tmpName = d->fileName + ".tmp";
+    QFile file(tmpName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "WARN: cannot write metrics to" << tmpName << ":" << file.errorString();
+        return;
+    }
+    file.write(toJson(report));
+    file.close();
+
+    QFile::remove(d->fileName);
+    if (!QFile::rename(tmpName, d->fileName))
+        qWarning() << "WARN: cannot rename" << tmpName << "to" << d->fileName;
+}
+
+QByteArray jsonString(const QString &s)
+{
+    QByteArray in = s.toUtf8();
+    QByteArray out = "\"";
+    for (int i = 0; i < in.size(); ++i) {
+        char c = in.at(i);
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (uchar(c) < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof buf, "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+    return out;
+}
+
+static QByteArray jsonCounter(qint64 count, qint64 nsecs)
+{
+    char buf[64];
+    snprintf(buf, sizeof buf, "{ \"count\": %lld, \"ms\": %.3f }", count, nsecs / 1e6);
+    return buf;
+}
+
+QByteArray Metrics::toJson(Report report) const
+{
+    Progress *progress = Progress::instance();
+    char buf[256];
+    snprintf(buf, sizeof buf,
+             "{\n  \"elapsed_ms\": %lld,\n  \"revision\": %d,\n"
+             "  \"revisions_per_second\": %.3f,\n  \"files_per_second\": %.3f,\n"
+             "  \"bytes_per_second\": %.0f,\n",
+             d->clock.elapsed(), progress->currentRevision(),
+             progress->revisionsPerSecond(), progress->filesPerSecond(),
+             progress->bytesPerSecond());
+
+    QByteArray json = buf;
+    json += "  \"phases\": {\n";
+    for (int i = 0; i < PhaseCount; ++i) {
+        json += "    \"";
+        json += phaseNames[i];
+        json += "\": ";
+        json += jsonCounter(d->phases[i].count, d->phases[i].nsecs);
+        json += i + 1 < PhaseCount ? ",\n" : "\n";
+    }
+    json += "  },\n  \"fast_import_wait_by_repository\": {";
+
+    QMap<QString, Private::Counter>::ConstIterator it = d->stalls.constBegin();
+    for ( ; it != d->stalls.constEnd(); ++it) {
+        json += it == d->stalls.constBegin() ? "\n    " : ",\n    ";
+        json += jsonString(it.key());
+        json += ": ";
+        json += jsonCounter(it->count, it->nsecs);
+    }
+    json += d->stalls.isEmpty() ? "}" : "\n  }";
+
+    json += ",\n  \"memory\": {\n    \"rss\": " + QByteArray::number(currentRss())
+            + ",\n    \"peak_rss\": " + QByteArray::number(peakRss());
+    if (report == FinalReport) {
+        json += ",\n    \"rule_stats\": " + QByteArray::number(Stats::instance()->memoryUsage());
+        QList<QPair<QByteArray, qint64> > structures = repositoryMemoryUsage();
+        for (int i = 0; i < structures.size(); ++i)
+            json += ",\n    \"" + structures.at(i).first + "\": " + QByteArray::number(structures.at(i).second);
+    }
+    json += "\n  },\n";
+    json += revisionsJson();
+    json += "}\n";
+    return json;
+}
+
+QByteArray Metrics::revisionsJson() const
+{
+    QByteArray json = "  \"revision_latency_ms\": {";
+    bool first = true;
+    for (int i = 0; i < histogramBuckets; ++i) {
+        if (!d->histogram[i])
+            continue;
+        // keyed by the upper bound of the bucket
+        json += first ? " \"" : ", \"";
+        json += i + 1 < histogramBuckets ? QByteArray::number(1 << i) : QByteArray("inf");
+        json += "\": " + QByteArray::number(d->histogram[i]);
+        first = false;
+    }
+    json += " },\n  \"slowest_revisions\": [";
+
+    for (int r = 0; r < d->slowest.size(); ++r) {
+        const Private::Revision &rev = d->slowest.at(r);
+        char buf[256];
+        snprintf(buf, sizeof buf,
+                 "%s\n    { \"revision\": %d, \"ms\": %.3f, \"changed_paths\": %d,"
+                 " \"recursion_depth\": %d, \"blob_bytes\": %lld, \"phases_ms\": {",
+                 r ? "," : "", rev.revnum, rev.nsecs / 1e6, rev.changedPaths,
+                 rev.recursionDepth, rev.blobBytes);
+        json += buf;
+        for (int i = 0; i < PhaseCount; ++i) {
+            snprintf(buf, sizeof buf, "%s \"%s\": %.3f", i ? "," : "", phaseNames[i], rev.phases[i] / 1e6);
+            json += buf;
+        }
+        json += " } }";
+    }
+    json += d->slowest.isEmpty() ? "]\n" : "\n  ]\n";
+    return json;
+}
@@ -0,0 +1,119 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QString>
+#include <QVector>
+
+/**
+ * Counts and times the main phases of a conversion and writes them out
+ * as a JSON report, periodically to the --metrics file and at the end
+ * of the run. It also keeps a latency histogram of the revisions and
+ * the slowest ones with their phase breakdown. Only used from the main
+ * thread.
+ */
+class Metrics
+{
+public:
+    enum Phase {
+        OpenRoot,
+        PathsChanged,
+        RuleMatching,
+        BlobRead,
+        FastImportWait,
+        MsgFilter,
+        Checkpoint,
+        ProcessStart,
+        PhaseCount
+    };
+
+    static Metrics *instance();
+    static void init();
+    ~Metrics();
+
+    bool isEnabled() const { return use; }
+
+    void add(Phase phase, qint64 nsecs);
+    void addStall(const QString &repository, qint64 nsecs);
+    qint64 total(Phase phase) const;
+    static qint64 currentRss();
+    static qint64 peakRss();
+
+    void beginRevision(int revnum);
+    void endRevision(int changedPaths, int recursionDepth);
+
+    // The final report adds the estimated sizes of the main structures,
+    // which take a walk over all of them
+    enum Report { LiveReport, FinalReport };
+
+    void tick();
+    void finish();
+    QByteArray toJson(Report report = LiveReport) const;
+
+private:
+    Metrics();
+    void writeReport(Report report);
+    QByteArray revisionsJson() const;
+    class Private;
+    Private * const d;
+    static Metrics *self;
+    bool use;
+};
+
+/**
+ * Adds the time between its construction and destruction to a phase.
+ */
+class MetricsTimer
+{
+public:
+    inline explicit MetricsTimer(Metrics::Phase p)
+        : phase(p), active(Metrics::instance()->isEnabled())
+    {
+        if (active)
+            timer.start();
+    }
+    inline ~MetricsTimer()
+    {
+        if (active)
+            Metrics::instance()->add(phase, timer.nsecsElapsed());
+    }
+
+private:
+    Q_DISABLE_COPY(MetricsTimer)
+    Metrics::Phase phase;
+    bool active;
+    QElapsedTimer timer;
+};
+
+// s quoted and escaped for use in a JSON document
+QByteArray jsonString(const QString &s);
+
+// Rough heap footprints for the memory report; implicitly shared data is
+// counted once per copy, and the allocator's own overhead is ignored.
+static const int containerHeader = 24;
+static const int hashNodeOverhead = 2 * sizeof(void *) + sizeof(uint);
+
+inline qint64 heapSize(const QByteArray &a)
+{ return a.capacity() ? a.capacity() + containerHeader : 0; }
+inline qint64 heapSize(const QString &s)
+{ return s.capacity() ? s.capacity() * 2 + containerHeader : 0; }
+template <typename T> inline qint64 heapSize(const QVector<T> &v)
+{ return v.capacity() ? v.capacity() * qint64(sizeof(T)) + containerHeader : 0; }
+
+#endif
@@ -0,0 +1,50 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * Static tracepoints for perf, bpftrace and systemtap, all in the
+ * "svn2git" provider. They are only compiled in when building with
+ * "qmake CONFIG+=usdt", which needs <sys/sdt.h> (systemtap-sdt-dev).
+ * The arguments are not evaluated otherwise.
+ *
+ *   revision__start(revnum)
+ *   revision__done(revnum)
+ *   rule__match(revnum, rule line number, path)
+ *   blob__start(path, size)
+ *   blob__done(path, size)
+ *   fastimport__stall(repository, nanoseconds)
+ *   process__start(repository)
+ *   process__evict(repository)
+ *
+ * Strings are UTF-8, e.g.
+ *   bpftrace -e 'usdt:./svn-all-fast-export:svn2git:blob__done { @[str(arg0)] = sum(arg1) }'
+ */
+
+#ifdef SVN2GIT_USDT
+#include <sys/sdt.h>
+
+#define SVN2GIT_PROBE1(name, a) DTRACE_PROBE1(svn2git, name, a)
+#define SVN2GIT_PROBE2(name, a, b) DTRACE_PROBE2(svn2git, name, a, b)
+#define SVN2GIT_PROBE3(name, a, b, c) DTRACE_PROBE3(svn2git, name, a, b, c)
+#else
+#define SVN2GIT_PROBE1(name, a) do {} while (0)
+#define SVN2GIT_PROBE2(name, a, b) do {} while (0)
+#define SVN2GIT_PROBE3(name, a, b, c) do {} while (0)
+#endif
+
+#endif
@@ -0,0 +1,212 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "progress.h"
+#include "metrics.h"
+#include "CommandLineParser.h"
+
+#include <QElapsedTimer>
+
+#include <stdio.h>
+#include <unistd.h>
+
+Progress *Progress::self = 0;
+
+class Progress::Private
+{
+public:
+    Private();
+
+    QElapsedTimer clock;
+    qint64 interval;
+    qint64 nextReport;
+    bool tty;
+
+    int firstRevision;
+    int lastRevision;
+    int currentRevision;
+    int revisionCount;      // to export in total, fewer than the range with --revisions-file
+
+    qint64 revisions;
+    qint64 files;
+    qint64 bytes;
+
+    // counters at the time of the previous report, for the current rate
+    qint64 lastTime;
+    qint64 lastRevisions;
+    qint64 lastFiles;
+    qint64 lastBytes;
+};
+
+Progress::Private::Private()
+    : interval(1000), nextReport(0), tty(false),
+      firstRevision(0), lastRevision(0), currentRevision(0), revisionCount(0),
+      revisions(0), files(0), bytes(0),
+      lastTime(0), lastRevisions(0), lastFiles(0), lastBytes(0)
+{
+}
+
+Progress::Progress() : d(new Private)
+{
+    d->tty = isatty(fileno(stdout));
+    // a log file doesn't need to be updated as often as a terminal
+    int seconds = d->tty ? 1 : 30;
+    if (CommandLineParser::instance()->contains("progress-interval"))
+        seconds = CommandLineParser::instance()->optionArgument("progress-interval").toInt();
+    d->interval = qMax(1, seconds) * 1000;
+    d->nextReport = d->interval;
+    d->clock.start();
+}
+
+Progress::~Progress()
+{
+    delete d;
+}
+
+void Progress::init()
+{
+    if(self)
+        delete self;
+    self = new Progress();
+}
+
+Progress *Progress::instance()
+{
+    return self;
+}
+
+void Progress::setRevisionRange(int first, int last)
+{
+    d->firstRevision = first;
+    d->lastRevision = last;
+    d->revisionCount = qMax(0, last - first + 1);
+}
+
+void Progress::setRevisionCount(int count)
+{
+    d->revisionCount = count;
+}
+
+inline void Progress::tick()
+{
+    if (d->clock.elapsed() >= d->nextReport)
+        report();
+}
+
+void Progress::revisionStarted(int revnum)
+{
+    d->currentRevision = revnum;
+    tick();
+}
+
+void Progress::revisionDone()
+{
+    ++d->revisions;
+    tick();
+}
+
+void Progress::fileExported(qint64 bytes)
+{
+    ++d->files;
+    d->bytes += bytes;
+    tick();
+}
+
+int Progress::currentRevision() const
+{
+    return d->currentRevision;
+}
+
+qint64 Progress::elapsed() const
+{
+    return d->clock.elapsed();
+}
+
+double Progress::revisionsPerSecond() const
+{
+    qint64 ms = d->clock.elapsed();
+    return ms ? d->revisions * 1000.0 / ms : 0;
+}
+
+double Progress::filesPerSecond() const
+{
+    qint64 ms = d->clock.elapsed();
+    return ms ? d->files * 1000.0 / ms : 0;
+}
+
+double Progress::bytesPerSecond() const
+{
+    qint64 ms = d->clock.elapsed();
+    return ms ? d->bytes * 1000.0 / ms : 0;
+}
+
+qint64 Progress::bytesExported() const
+{
+    return d->bytes;
+}
+
+static QByteArray formatDuration(qint64 seconds)
+{
+    char buf[32];
+    snprintf(buf, sizeof buf, "%lld:%02lld:%02lld",
+             seconds / 3600, (seconds / 60) % 60, seconds % 60);
+    return buf;
+}
+
+void Progress::report()
+{
+    qint64 now = d->clock.elapsed();
+    d->nextReport = now + d->interval;
+
+    // rates since the last report, the ETA uses the average of the whole run
+    double seconds = qMax<qint64>(1, now - d->lastTime) / 1000.0;
+    double revRate = (d->revisions - d->lastRevisions) / seconds;
+    double fileRate = (d->files - d->lastFiles) / seconds;
+    double mbRate = (d->bytes - d->lastBytes) / seconds / (1024 * 1024);
+    d->lastTime = now;
+    d->lastRevisions = d->revisions;
+    d->lastFiles = d->files;
+    d->lastBytes = d->bytes;
+
+    QByteArray eta = "--:--:--";
+    double average = revisionsPerSecond();
+    if (average > 0 && d->revisionCount >= d->revisions)
+        eta = formatDuration(qint64((d->revisionCount - d->revisions) / average));
+
+    char line[256];
+    snprintf(line, sizeof line, "r%d/%d  %.1f rev/s  %.1f files/s  %.2f MB/s  RSS %lld MB  elapsed %s  ETA %s",
+             d->currentRevision, d->lastRevision, revRate, fileRate, mbRate,
+             Metrics::currentRss() / (1024 * 1024),
+             formatDuration(now / 1000).constData(), eta.constData());
+
+    if (d->tty) {
+        printf("\r%-100s", line);
+        fflush(stdout);
+    } else {
+        // a file or pipe is fully buffered, which would hold the line back
+        printf("progress: %s\n", line);
+        fflush(stdout);
+    }
+}
+
+void Progress::finish()
+{
+    report();
+    if (d->tty)
+        printf("\n");
+    printf("Exported %lld revisions, %lld files, %.2f MB in %s\n",
+           d->revisions, d->files, d->bytes / (1024.0 * 1024.0),
+           formatDuration(d->clock.elapsed() / 1000).constData());
+}
@@ -0,0 +1,56 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <QtGlobal>
+
+/**
+ * Reports how far the conversion got, at most once per interval.
+ * On a terminal a single status line is kept up to date, otherwise a
+ * plain line is printed each time.
+ */
+class Progress
+{
+public:
+    static Progress *instance();
+    static void init();
+    ~Progress();
+
+    void setRevisionRange(int first, int last);
+    void setRevisionCount(int count);
+    void revisionStarted(int revnum);
+    void revisionDone();
+    void fileExported(qint64 bytes);
+    void finish();
+
+    int currentRevision() const;
+    qint64 elapsed() const;
+    double revisionsPerSecond() const;
+    double filesPerSecond() const;
+    double bytesPerSecond() const;
+    qint64 bytesExported() const;
+
+private:
+    Progress();
+    inline void tick();
+    void report();
+    class Private;
+    Private * const d;
+    static Progress *self;
+};
+
+#endif
@@ -18,18 +18,51 @@
 
 #include "repository.h"
 #include "CommandLineParser.h"
+#include "metrics.h"
+#include "probes.h"
+#include "trace.h"
 #include <QTextStream>
 #include <QDataStream>
 #include <QDebug>
 #include <QDir>
+#include <QElapsedTimer>
 #include <QFile>
 #include <QLinkedList>
+#include <QTemporaryFile>
 
 static const int maxSimultaneousProcesses = 100;
+static const int largestBlobCount = 10;
+static const int changeBufferLimit = 32 * 1024 * 1024;
 
 typedef unsigned long long mark_t;
 static const mark_t maxMark = ULONG_MAX;
 
+class FastImportRepository;
+
+/*
+ * The "D" or "M" lines of a transaction, which can only be written once
+ * the commit is. Past changeBufferLimit bytes they are moved to a
+ * temporary file, so a revision touching millions of files doesn't keep
+ * them all in memory.
+ */
+class ChangeBuffer
+{
+public:
+    ChangeBuffer() : file(0), lines(0) {}
+    ~ChangeBuffer() { delete file; }
+
+    void append(const QByteArray &line);
+    int lineCount() const { return lines; }
+    qint64 memoryUsage() const { return heapSize(buffer); }
+    void writeTo(FastImportRepository *repository);
+
+private:
+    Q_DISABLE_COPY(ChangeBuffer)
+    QByteArray buffer;
+    QTemporaryFile *file;
+    int lines;
+};
+
 class FastImportRepository : public Repository
 {
 public:
@@ -57,10 +90,14 @@ public:
 
         QVector<int> merges;
 
-        QStringList deletedFiles;
-        QByteArray modifiedFiles;
+        bool deleteAll;
+        ChangeBuffer deletedFiles;
+        ChangeBuffer modifiedFiles;
+
+        qint64 blobs;
+        qint64 blobBytes;
 
-        inline Transaction() {}
+        inline Transaction() : deleteAll(false) {}
     public:
         ~Transaction();
         int commit();
@@ -78,6 +115,7 @@ public:
                         const QByteArray &commit = QByteArray());
     };
     FastImportRepository(const Rules::Repository &rule);
+    void initialize();
     int setupIncremental(int &cutoff);
     void restoreAnnotatedTags();
     void restoreBranchNotes();
@@ -105,6 +143,8 @@ public:
 
     QString getName() const;
     Repository *getEffectiveRepository();
+    void printStats() const;
+    void addMemoryUsage(QHash<QByteArray, qint64> &sizes) const;
 private:
     struct Branch
     {
@@ -113,11 +153,35 @@ private:
         QVector<int> marks;
     };
 
+    /* What was sent to fast-import, in total and per branch */
+    struct Usage
+    {
+        Usage() : commits(0), blobs(0), blobBytes(0), resets(0), notes(0) {}
+        qint64 commits;
+        qint64 blobs;
+        qint64 blobBytes;
+        qint64 resets;
+        qint64 notes;
+    };
+    struct LargeBlob
+    {
+        qint64 size;
+        int revnum;
+        QByteArray svnprefix;
+        QByteArray branch;
+        QByteArray path;
+    };
+
     QHash<QString, Branch> branches;
+    QHash<QString, Branch> ruleBranches;    // before setupIncremental()
     QHash<QString, QByteArray> branchNotes;
+    Usage usage;
+    QHash<QByteArray, Usage> branchUsage;
+    QList<LargeBlob> largestBlobs;       // largest first
     QHash<QString, AnnotatedTag> annotatedTags;
     QString name;
     QString prefix;
+    QString description;
     LoggingQProcess fastImport;
     int commitCount;
     int outstandingTransactions;
@@ -126,6 +190,11 @@ private:
     QSet<QString> deletedBranchNames;
     QSet<QString> resetBranchNames;
 
+    /* Notes are collected here and written out as one notes commit */
+    QByteArray pendingNotes;
+    QByteArray pendingNotesCommitter;
+    int pendingNoteCount;
+
   /* Optional filter to fix up log messages */
     QProcess filterMsg;
     QByteArray msgFilter(QByteArray);
@@ -137,9 +206,23 @@ private:
     mark_t next_file_mark;
 
     bool processHasStarted;
+    int processStarts;
+
+    /* Branches reset in the running fast-import, see loadBranch() */
+    QSet<QString> loadedBranches;
+    bool notesLoaded;
+
+    /* Most bytes a single Transaction buffered before its commit */
+    qint64 largestTransaction;
 
     void startFastImport();
+    void waitForFastImport();
+    void printUsage(int maxBranches) const;
     void closeFastImport();
+    void waitForExit(bool checkpointed);
+    void flushNotes();
+    void loadBranch(const QString &branch);
+    void loadNotes();
 
     // called when a transaction is deleted
     void forgetTransaction(Transaction *t);
@@ -148,6 +231,7 @@ private:
     long long markFrom(const QString &branchFrom, int branchRevNum, QByteArray &desc);
 
     friend class ProcessCache;
+    friend class ChangeBuffer;
     Q_DISABLE_COPY(FastImportRepository)
 };
 
@@ -186,6 +270,7 @@ public:
 
     ForwardingRepository(const QString &n, Repository *r, const QString &p) : name(n), repo(r), prefix(p) {}
 
+    void initialize() {}
     int setupIncremental(int &) { return 1; }
     void restoreAnnotatedTags() {}
     void restoreBranchNotes() {}
@@ -227,18 +312,30 @@ public:
     { return name; }
     Repository *getEffectiveRepository()
     { return repo->getEffectiveRepository(); }
+    void printStats() const { /* accounted in 'repo' */ }
 };
 
 class ProcessCache: QLinkedList<FastImportRepository *>
 {
 public:
+    ProcessCache() : hits(0), misses(0) {}
+    void closeAll();
+    QByteArray status() const;
+
+    // whether fast-import was still running when a repository needed it
+    qint64 hits;
+    qint64 misses;
+
     void touch(FastImportRepository *repo)
     {
         remove(repo);
 
         // if the cache is too big, remove from the front
-        while (size() >= maxSimultaneousProcesses)
-            takeFirst()->closeFastImport();
+        while (size() >= maxSimultaneousProcesses) {
+            FastImportRepository *evicted = takeFirst();
+            SVN2GIT_PROBE1(process__evict, qPrintable(evicted->name));
+            evicted->closeFastImport();
+        }
 
         // append to the end
         append(repo);
@@ -255,6 +352,77 @@ public:
 };
 static ProcessCache processCache;
 
+// for the memory report
+static QList<FastImportRepository *> liveRepositories;
+
+static int fastImportTimeout()
+{
+    int timeout = CommandLineParser::instance()->optionArgument(QLatin1String("fast-import-timeout"), QLatin1String("30")).toInt();
+    if(timeout == 0) {
+        qDebug() << "Waiting forever for fast-import to finish.";
+        return -1;
+    }
+    qDebug() << "Waiting" << timeout << "seconds for fast-import to finish.";
+    return timeout * 10000;
+}
+
+void ProcessCache::closeAll()
+{
+    // Tell every fast-import to finish before waiting for any of them, so
+    // that they write out their packs concurrently instead of one by one.
+    QList<FastImportRepository *> repos;
+    while (!isEmpty())
+        repos.append(takeFirst());
+
+    QList<bool> checkpointed;
+    foreach (FastImportRepository *repo, repos) {
+        if (repo->fastImport.state() == QProcess::NotRunning) {
+            checkpointed.append(false);
+            continue;
+        }
+        repo->flushNotes();
+        repo->fastImport.write("checkpoint\n");
+        checkpointed.append(repo->fastImport.waitForBytesWritten(-1));
+        repo->fastImport.closeWriteChannel();
+    }
+
+    // each process gets the whole timeout, they have all been packing since
+    for (int i = 0; i < repos.size(); ++i) {
+        FastImportRepository *repo = repos.at(i);
+        if (repo->fastImport.state() != QProcess::NotRunning)
+            repo->waitForExit(checkpointed.at(i));
+        repo->processHasStarted = false;
+    }
+}
+
+void closeFastImports()
+{
+    processCache.closeAll();
+}
+
+QByteArray ProcessCache::status() const
+{
+    QByteArray json = "{ \"processes\": " + QByteArray::number(size())
+                      + ", \"capacity\": " + QByteArray::number(maxSimultaneousProcesses)
+                      + ", \"hits\": " + QByteArray::number(hits)
+                      + ", \"misses\": " + QByteArray::number(misses)
+                      + ", \"running\": {";
+    for (ConstIterator it = constBegin(); it != constEnd(); ++it) {
+        const FastImportRepository *repo = *it;
+        json += it == constBegin() ? " " : ", ";
+        json += jsonString(repo->name) + ": { \"queued_bytes\": "
+                + QByteArray::number(repo->fastImport.bytesToWrite())
+                + ", \"starts\": " + QByteArray::number(repo->processStarts) + " }";
+    }
+    json += " } }";
+    return json;
+}
+
+QByteArray fastImportStatus()
+{
+    return processCache.status();
+}
+
 QDataStream &operator<<(QDataStream &out, const FastImportRepository::AnnotatedTag &annotatedTag)
 {
     out << annotatedTag.supportingRef
@@ -316,9 +484,15 @@ static QString branchNotesFileName(QString name)
 }
 
 FastImportRepository::FastImportRepository(const Rules::Repository &rule)
-    : name(rule.name), prefix(rule.forwardTo), fastImport(name), commitCount(0), outstandingTransactions(0),
-      last_commit_mark(0), next_file_mark(maxMark - 1), processHasStarted(false)
+    : name(rule.name), prefix(rule.forwardTo), description(rule.description), fastImport(name), commitCount(0), outstandingTransactions(0),
+      pendingNoteCount(0), last_commit_mark(0), next_file_mark(maxMark - 1), processHasStarted(false),
+      processStarts(0), notesLoaded(false), largestTransaction(0)
 {
+    liveRepositories.append(this);
+
+    // lets the blob writer in svn.cpp attribute its stalls to us
+    fastImport.setObjectName(name);
+
     foreach (Rules::Repository::Branch branchRule, rule.branches) {
         Branch branch;
         branch.created = 1;
@@ -328,36 +502,80 @@ FastImportRepository::FastImportRepository(const Rules::Repository &rule)
 
     // create the default branch
     branches["master"].created = 1;
+    ruleBranches = branches;
 
-    if (!CommandLineParser::instance()->contains("dry-run") && !CommandLineParser::instance()->contains("create-dump")) {
+    if (!CommandLineParser::instance()->contains("dry-run") && !CommandLineParser::instance()->contains("create-dump"))
         fastImport.setWorkingDirectory(name);
-        if (!QDir(name).exists()) { // repo doesn't exist yet.
-            qDebug() << "Creating new repository" << name;
-            QDir::current().mkpath(name);
-            QProcess init;
-            init.setWorkingDirectory(name);
-            init.start("git", QStringList() << "--bare" << "init");
-            init.waitForFinished(-1);
-            QProcess casesensitive;
-            casesensitive.setWorkingDirectory(name);
-            casesensitive.start("git", QStringList() << "config" << "core.ignorecase" << "false");
-            casesensitive.waitForFinished(-1);
-            // Write description
-            if (!rule.description.isEmpty()) {
-                QFile fDesc(QDir(name).filePath("description"));
-                if (fDesc.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text)) {
-                            fDesc.write(rule.description.toUtf8());
-                    fDesc.putChar('\n');
-                    fDesc.close();
-                }
-            }
-            {
-                QFile marks(name + "/" + marksFileName(name));
-                marks.open(QIODevice::WriteOnly);
-                marks.close();
-            }
+}
+
+static bool writeFile(const QString &fileName, const QByteArray &contents)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+    bool written = file.write(contents) == contents.size();
+    file.close();
+    return written;
+}
+
+// What "git --bare init" followed by "git config core.ignorecase false"
+// leaves behind, without the sample hooks and without spawning git twice.
+static bool writeBareRepository(const QString &name)
+{
+    QDir dir(name);
+    return dir.mkpath("objects/info") && dir.mkpath("objects/pack")
+        && dir.mkpath("refs/heads") && dir.mkpath("refs/tags")
+        && dir.mkpath("info") && dir.mkpath("hooks")
+        && writeFile(dir.filePath("HEAD"), "ref: refs/heads/master\n")
+        && writeFile(dir.filePath("config"),
+                     "[core]\n"
+                     "\trepositoryformatversion = 0\n"
+                     "\tfilemode = true\n"
+                     "\tbare = true\n"
+                     "\tignorecase = false\n")
+        && writeFile(dir.filePath("description"),
+                     "Unnamed repository; edit this file 'description' to name the repository.\n");
+}
+
+void FastImportRepository::initialize()
+{
+    if (CommandLineParser::instance()->contains("dry-run") || CommandLineParser::instance()->contains("create-dump"))
+        return;
+    if (QDir(name).exists()) // repo exists already
+        return;
+
+    qDebug() << "Creating new repository" << name;
+    // another loader thread may be creating a common parent directory,
+    // which makes the first attempt fail with Qt 4
+    if (!QDir::current().mkpath(name) && !QDir::current().mkpath(name))
+        qFatal("Failed to create directory %s", qPrintable(name));
+    if (CommandLineParser::instance()->contains("fast-init")) {
+        if (!writeBareRepository(name))
+            qFatal("Failed to create repository %s", qPrintable(name));
+    } else {
+        QProcess init;
+        init.setWorkingDirectory(name);
+        init.start("git", QStringList() << "--bare" << "init");
+        init.waitForFinished(-1);
+        QProcess casesensitive;
+        casesensitive.setWorkingDirectory(name);
+        casesensitive.start("git", QStringList() << "config" << "core.ignorecase" << "false");
+        casesensitive.waitForFinished(-1);
+    }
+    // Write description
+    if (!description.isEmpty()) {
+        QFile fDesc(QDir(name).filePath("description"));
+        if (fDesc.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text)) {
+                    fDesc.write(description.toUtf8());
+            fDesc.putChar('\n');
+            fDesc.close();
         }
     }
+    {
+        QFile marks(name + "/" + marksFileName(name));
+        marks.open(QIODevice::WriteOnly);
+        marks.close();
+    }
 }
 
 static QString logFileName(QString name)
@@ -421,6 +639,10 @@ static mark_t lastValidMark(QString name)
 
 int FastImportRepository::setupIncremental(int &cutoff)
 {
+    // called again when another repository rewinds the cutoff
+    branches = ruleBranches;
+    last_commit_mark = 0;
+
     QFile logfile(logFileName(name));
     if (!logfile.exists())
         return 1;
@@ -535,61 +757,83 @@ FastImportRepository::~FastImportRepository()
 {
     Q_ASSERT(outstandingTransactions == 0);
     closeFastImport();
+    liveRepositories.removeAll(this);
 }
 
 void FastImportRepository::closeFastImport()
 {
     if (fastImport.state() != QProcess::NotRunning) {
-        int fastImportTimeout = CommandLineParser::instance()->optionArgument(QLatin1String("fast-import-timeout"), QLatin1String("30")).toInt();
-        if(fastImportTimeout == 0) {
-            qDebug() << "Waiting forever for fast-import to finish.";
-            fastImportTimeout = -1;
-        } else {
-            qDebug() << "Waiting" << fastImportTimeout << "seconds for fast-import to finish.";
-            fastImportTimeout *= 10000;
-        }
+        flushNotes();
         fastImport.write("checkpoint\n");
-        fastImport.waitForBytesWritten(-1);
+        bool checkpointed = fastImport.waitForBytesWritten(-1);
         fastImport.closeWriteChannel();
-        if (!fastImport.waitForFinished(fastImportTimeout)) {
-            fastImport.terminate();
-            if (!fastImport.waitForFinished(200))
-                qWarning() << "WARN: git-fast-import for repository" << name << "did not die";
-        }
+        waitForExit(checkpointed);
     }
     processHasStarted = false;
     processCache.remove(this);
 }
 
+/*
+ * Waits for fast-import to exit once its input is closed. After a
+ * checkpoint it may still be writing out a large pack and the marks, so
+ * it is only killed then if the user asked for a timeout.
+ */
+void FastImportRepository::waitForExit(bool checkpointed)
+{
+    int timeout = fastImportTimeout();
+    if (fastImport.waitForFinished(timeout))
+        return;
+
+    if (checkpointed && !CommandLineParser::instance()->contains("fast-import-timeout")) {
+        qWarning() << "WARN: git-fast-import for repository" << name << "is taking long to finish, still waiting";
+        fastImport.waitForFinished(-1);
+        return;
+    }
+
+    fastImport.terminate();
+    if (!fastImport.waitForFinished(200))
+        qWarning() << "WARN: git-fast-import for repository" << name << "did not die";
+}
+
 void FastImportRepository::reloadBranches()
 {
-    bool reset_notes = false;
-    foreach (QString branch, branches.keys()) {
-        Branch &br = branches[branch];
+    // A fresh fast-import knows none of our branches. Rather than resetting
+    // all of them up front, each one is reset when it is first used.
+    loadedBranches.clear();
 
-        if (br.marks.isEmpty() || !br.marks.last())
-            continue;
+    // nothing committed yet means there is no notes commit to continue from either
+    notesLoaded = last_commit_mark == 0;
+}
 
-        reset_notes = true;
+void FastImportRepository::loadBranch(const QString &branch)
+{
+    startFastImport();
+    if (loadedBranches.contains(branch))
+        return;
+    loadedBranches.insert(branch);
 
-        QByteArray branchRef = branch.toUtf8();
-        if (!branchRef.startsWith("refs/"))
-            branchRef.prepend("refs/heads/");
+    QHash<QString, Branch>::ConstIterator br = branches.constFind(branch);
+    if (br == branches.constEnd() || br->marks.isEmpty() || !br->marks.last())
+        return;
 
-        startFastImport();
-        fastImport.write("reset " + branchRef +
-                        "\nfrom :" + QByteArray::number(br.marks.last()) + "\n\n"
-                        "progress Branch " + branchRef + " reloaded\n");
-    }
+    QByteArray branchRef = branch.toUtf8();
+    if (!branchRef.startsWith("refs/"))
+        branchRef.prepend("refs/heads/");
 
-    if (reset_notes &&
-        CommandLineParser::instance()->contains("add-metadata-notes")) {
+    fastImport.write("reset " + branchRef +
+                    "\nfrom :" + QByteArray::number(br->marks.last()) + "\n\n"
+                    "progress Branch " + branchRef + " reloaded\n");
+}
 
-        startFastImport();
-        fastImport.write("reset refs/notes/commits\nfrom :" +
-                         QByteArray::number(maxMark) +
-                         "\n");
-    }
+void FastImportRepository::loadNotes()
+{
+    if (notesLoaded)
+        return;
+    notesLoaded = true;
+
+    fastImport.write("reset refs/notes/commits\nfrom :" +
+                     QByteArray::number(maxMark) +
+                     "\n");
 }
 
 long long FastImportRepository::markFrom(const QString &branchFrom, int branchRevNum, QByteArray &branchFromDesc)
@@ -639,9 +883,16 @@ int FastImportRepository::createBranch(const QString &branch, int revnum,
     if (!mark) {
         qWarning() << "WARN:" << branch << "in repository" << name << "is branching but no exported commits exist in repository"
                 << "creating an empty branch.";
-        branchFromRef = branchFrom.toUtf8();
-        if (!branchFromRef.startsWith("refs/"))
-            branchFromRef.prepend("refs/heads/");
+        // The branch as it is now. By its mark where it has one, as the reset
+        // is only written in commit(), possibly to another fast-import process.
+        const Branch &brFrom = branches[branchFrom];
+        if (!brFrom.marks.isEmpty() && brFrom.marks.last()) {
+            branchFromRef = ":" + QByteArray::number(brFrom.marks.last());
+        } else {
+            branchFromRef = branchFrom.toUtf8();
+            if (!branchFromRef.startsWith("refs/"))
+                branchFromRef.prepend("refs/heads/");
+        }
         branchFromDesc += ", deleted/unknown";
     }
 
@@ -675,13 +926,18 @@ int FastImportRepository::resetBranch(const QString &branch, int revnum, mark_t
             backupBranch = "refs/backups/r" + QByteArray::number(revnum) + branchRef.mid(4);
         qWarning() << "WARN: backing up branch" << branch << "to" << backupBranch;
 
-        backupCmd = "reset " + backupBranch + "\nfrom " + branchRef + "\n\n";
+        // by mark rather than by name, so it does not depend on the branch
+        // having been reset in the fast-import that commit() writes to
+        backupCmd = "reset " + backupBranch + "\nfrom :" + QByteArray::number(br.marks.last()) + "\n\n";
     }
 
     br.created = revnum;
     br.commits.append(revnum);
     br.marks.append(mark);
 
+    ++usage.resets;
+    ++branchUsage[branch.toUtf8()].resets;
+
     QByteArray cmd = "reset " + branchRef + "\nfrom " + resetTo + "\n\n"
                      "progress SVN r" + QByteArray::number(revnum)
                      + " branch " + branch.toUtf8() + " = :" + QByteArray::number(mark)
@@ -736,12 +992,18 @@ Repository::Transaction *FastImportRepository::newTransaction(const QString &bra
     txn->svnprefix = svnprefix.toUtf8();
     txn->datetime = 0;
     txn->revnum = revnum;
+    txn->blobs = 0;
+    txn->blobBytes = 0;
 
     if ((++commitCount % CommandLineParser::instance()->optionArgument(QLatin1String("commit-interval"), QLatin1String("10000")).toInt()) == 0) {
         startFastImport();
+        MetricsTimer timer(Metrics::Checkpoint);
         // write everything to disk every 10000 commits
+        flushNotes();
         fastImport.write("checkpoint\n");
         qDebug() << "checkpoint!, marks file truncated";
+        if (CommandLineParser::instance()->contains("stats"))
+            printUsage(10);
     }
     outstandingTransactions++;
     return txn;
@@ -790,6 +1052,8 @@ void FastImportRepository::finalizeTags()
     printf("Finalising annotated tags for %s...", qPrintable(name));
     startFastImport();
 
+    // all tags go to fast-import in a single write
+    QByteArray s;
     QHash<QString, AnnotatedTag>::ConstIterator it = annotatedTags.constBegin();
     for ( ; it != annotatedTags.constEnd(); ++it) {
         const QString &tagName = it.key();
@@ -805,19 +1069,17 @@ void FastImportRepository::finalizeTags()
             QByteArray branchRef = tag.supportingRef.toUtf8();
             if (!branchRef.startsWith("refs/"))
                 branchRef.prepend("refs/heads/");
+            loadBranch(tag.supportingRef);
 
-            QByteArray s = "progress Creating annotated tag " + tagName.toUtf8() + " from ref " + branchRef + "\n"
+            s.append("progress Creating annotated tag " + tagName.toUtf8() + " from ref " + branchRef + "\n"
               + "tag " + tagName.toUtf8() + "\n"
               + "from " + branchRef + "\n"
               + "tagger " + tag.author + ' ' + QByteArray::number(tag.dt) + " +0000" + "\n"
-              + "data " + QByteArray::number( message.length() ) + "\n";
-            fastImport.write(s);
+              + "data " + QByteArray::number( message.length() ) + "\n");
         }
 
-        fastImport.write(message);
-        fastImport.putChar('\n');
-        if (!fastImport.waitForBytesWritten(-1))
-            qFatal("Failed to write to process: %s", qPrintable(fastImport.errorString()));
+        s.append(message);
+        s.append('\n');
 
         // Append note to the tip commit of the supporting ref. There is no
         // easy way to attach a note to the tag itself with fast-import.
@@ -825,23 +1087,42 @@ void FastImportRepository::finalizeTags()
             Repository::Transaction *txn = newTransaction(tag.supportingRef, tag.svnprefix, tag.revnum);
             txn->setAuthor(tag.author);
             txn->setDateTime(tag.dt);
-            bool written = txn->commitNote(formatMetadataMessage(tag.svnprefix, tag.revnum, tagName.toUtf8()), true);
+            txn->commitNote(formatMetadataMessage(tag.svnprefix, tag.revnum, tagName.toUtf8()), true);
             delete txn;
-
-            if (written && !fastImport.waitForBytesWritten(-1))
-                qFatal("Failed to write to process: %s", qPrintable(fastImport.errorString()));
         }
 
         printf(" %s", qPrintable(tagName));
-        fflush(stdout);
     }
 
-    while (fastImport.bytesToWrite())
-        if (!fastImport.waitForBytesWritten(-1))
-            qFatal("Failed to write to process: %s", qPrintable(fastImport.errorString()));
+    fastImport.write(s);
+    flushNotes();
+    waitForFastImport();
     printf("\n");
 }
 
+void FastImportRepository::flushNotes()
+{
+    if (!pendingNoteCount)
+        return;
+    loadNotes();
+
+    // fast-import takes care of the notes fan-out itself
+    QByteArray message = "Adding Git notes for " + QByteArray::number(pendingNoteCount) + " commits\n";
+
+    QByteArray s("");
+    s.append("commit refs/notes/commits\n");
+    s.append("mark :" + QByteArray::number(maxMark) + "\n");
+    s.append("committer " + pendingNotesCommitter + "\n");
+    s.append("data " + QByteArray::number(message.length()) + "\n");
+    s.append(message + "\n");
+    fastImport.write(s);
+    fastImport.write(pendingNotes);
+    fastImport.write("\n");
+
+    pendingNotes.clear();
+    pendingNoteCount = 0;
+}
+
 void FastImportRepository::saveBranchNotes()
 {
     if (branchNotes.isEmpty())
@@ -860,6 +1141,7 @@ FastImportRepository::msgFilter(QByteArray msg)
     QByteArray output = msg;
 
     if (CommandLineParser::instance()->contains("msg-filter")) {
+        MetricsTimer timer(Metrics::MsgFilter);
         if (filterMsg.state() == QProcess::Running)
             qFatal("filter process already running?");
 
@@ -880,10 +1162,17 @@ void FastImportRepository::startFastImport()
 {
     processCache.touch(this);
 
-    if (fastImport.state() == QProcess::NotRunning) {
+    if (fastImport.state() != QProcess::NotRunning) {
+        ++processCache.hits;
+    } else {
+        ++processCache.misses;
         if (processHasStarted)
             qFatal("git-fast-import has been started once and crashed?");
+        MetricsTimer timer(Metrics::ProcessStart);
+        SVN2GIT_PROBE1(process__start, qPrintable(name));
         processHasStarted = true;
+        if (processStarts++)
+            qDebug() << "Restarting fast-import for" << name << "(" << processStarts - 1 << "restarts so far)";
 
         // start the process
         QString marksFile = marksFileName(name);
@@ -906,6 +1195,116 @@ void FastImportRepository::startFastImport()
     }
 }
 
+static bool largerUsage(const QPair<QByteArray, qint64> &a, const QPair<QByteArray, qint64> &b)
+{
+    return a.second > b.second;
+}
+
+// Prints what was sent to fast-import, with at most maxBranches branches
+// (-1 for all of them), largest first.
+void FastImportRepository::printUsage(int maxBranches) const
+{
+    printf("Repository %s: %lld commits, %lld blobs (%.2f MB), %lld resets, %lld notes\n",
+           qPrintable(name), usage.commits, usage.blobs, usage.blobBytes / (1024.0 * 1024.0),
+           usage.resets, usage.notes);
+
+    QList<QPair<QByteArray, qint64> > bySize;
+    QHash<QByteArray, Usage>::ConstIterator it = branchUsage.constBegin();
+    for ( ; it != branchUsage.constEnd(); ++it)
+        bySize.append(qMakePair(it.key(), it->blobBytes));
+    qSort(bySize.begin(), bySize.end(), largerUsage);
+    if (maxBranches >= 0 && bySize.size() > maxBranches)
+        bySize = bySize.mid(0, maxBranches);
+
+    for (int i = 0; i < bySize.size(); ++i) {
+        Usage u = branchUsage.value(bySize.at(i).first);
+        printf("  branch %s: %lld commits, %lld blobs (%.2f MB), %lld resets, %lld notes\n",
+               bySize.at(i).first.constData(), u.commits, u.blobs, u.blobBytes / (1024.0 * 1024.0),
+               u.resets, u.notes);
+    }
+    if (bySize.size() < branchUsage.size())
+        printf("  ... and %d more branches\n", branchUsage.size() - bySize.size());
+
+    if (largestBlobs.isEmpty())
+        return;
+    printf("  largest blobs:\n");
+    foreach (const LargeBlob &blob, largestBlobs)
+        printf("    %10.2f MB  r%d %s -> %s:%s\n", blob.size / (1024.0 * 1024.0), blob.revnum,
+               blob.svnprefix.constData(), blob.branch.constData(), blob.path.constData());
+}
+
+void FastImportRepository::printStats() const
+{
+    if (CommandLineParser::instance()->contains("stats"))
+        printUsage(-1);
+}
+
+void FastImportRepository::addMemoryUsage(QHash<QByteArray, qint64> &sizes) const
+{
+    qint64 size = 0;
+    QHash<QString, Branch>::ConstIterator br = branches.constBegin();
+    for ( ; br != branches.constEnd(); ++br)
+        size += hashNodeOverhead + sizeof(Branch) + heapSize(br.key())
+                + heapSize(br->commits) + heapSize(br->marks);
+    sizes["branches"] += size;
+
+    size = 0;
+    QHash<QString, AnnotatedTag>::ConstIterator tag = annotatedTags.constBegin();
+    for ( ; tag != annotatedTags.constEnd(); ++tag)
+        size += hashNodeOverhead + sizeof(AnnotatedTag) + heapSize(tag.key())
+                + heapSize(tag->supportingRef) + heapSize(tag->svnprefix)
+                + heapSize(tag->author) + heapSize(tag->log);
+    sizes["annotated_tags"] += size;
+
+    size = 0;
+    QHash<QString, QByteArray>::ConstIterator note = branchNotes.constBegin();
+    for ( ; note != branchNotes.constEnd(); ++note)
+        size += hashNodeOverhead + 2 * sizeof(void *) + heapSize(note.key()) + heapSize(*note);
+    sizes["branch_notes"] += size + heapSize(pendingNotes);
+
+    size = 0;
+    QHash<QByteArray, Usage>::ConstIterator use = branchUsage.constBegin();
+    for ( ; use != branchUsage.constEnd(); ++use)
+        size += hashNodeOverhead + sizeof(Usage) + heapSize(use.key());
+    foreach (const QString &loaded, loadedBranches)
+        size += hashNodeOverhead + heapSize(loaded);
+    sizes["branch_accounting"] += size;
+
+    sizes["fast_import_queue"] += fastImport.bytesToWrite();
+    sizes["largest_transaction"] = qMax(sizes.value("largest_transaction"), largestTransaction);
+}
+
+// Estimated sizes of the in-memory state of all repositories, by structure
+QList<QPair<QByteArray, qint64> > repositoryMemoryUsage()
+{
+    QHash<QByteArray, qint64> sizes;
+    foreach (const FastImportRepository *repo, liveRepositories)
+        repo->addMemoryUsage(sizes);
+
+    QList<QByteArray> keys = sizes.keys();
+    qSort(keys);
+    QList<QPair<QByteArray, qint64> > result;
+    foreach (const QByteArray &key, keys)
+        result.append(qMakePair(key, sizes.value(key)));
+    return result;
+}
+
+// Blocks until fast-import has read everything we wrote to it
+void FastImportRepository::waitForFastImport()
+{
+    if (!fastImport.bytesToWrite())
+        return;
+
+    QElapsedTimer stall;
+    stall.start();
+    while (fastImport.bytesToWrite())
+        if (!fastImport.waitForBytesWritten(-1))
+            qFatal("Failed to write to process: %s for repository %s", qPrintable(fastImport.errorString()), qPrintable(name));
+    qint64 nsecs = stall.nsecsElapsed();
+    Metrics::instance()->addStall(name, nsecs);
+    SVN2GIT_PROBE2(fastimport__stall, qPrintable(name), nsecs);
+}
+
 QByteArray Repository::formatMetadataMessage(const QByteArray &svnprefix, int revnum, const QByteArray &tag)
 {
     QByteArray msg = "svn path=" + svnprefix + "; revision=" + QByteArray::number(revnum);
@@ -946,6 +1345,40 @@ Repository *FastImportRepository::getEffectiveRepository()
     return this;
 }
 
+void ChangeBuffer::append(const QByteArray &line)
+{
+    if (buffer.capacity() == 0)
+        buffer.reserve(2048);
+    buffer.append(line);
+    ++lines;
+    if (buffer.size() < changeBufferLimit)
+        return;
+
+    if (!file) {
+        file = new QTemporaryFile;
+        if (!file->open())
+            qFatal("Failed to open a temporary file for the changes of a revision: %s",
+                   qPrintable(file->errorString()));
+    }
+    if (file->write(buffer) != buffer.size())
+        qFatal("Failed to write the changes of a revision to %s: %s",
+               qPrintable(file->fileName()), qPrintable(file->errorString()));
+    buffer.clear();
+}
+
+// Writes the lines to fast-import in the order they were added
+void ChangeBuffer::writeTo(FastImportRepository *repository)
+{
+    if (file) {
+        file->seek(0);
+        while (!file->atEnd()) {
+            repository->fastImport.write(file->read(1024 * 1024));
+            repository->waitForFastImport();
+        }
+    }
+    repository->fastImport.write(buffer);
+}
+
 FastImportRepository::Transaction::~Transaction()
 {
     repository->forgetTransaction(this);
@@ -999,7 +1432,10 @@ void FastImportRepository::Transaction::deleteFile(const QString &path)
     QString pathNoSlash = repository->prefix + path;
     if(pathNoSlash.endsWith('/'))
         pathNoSlash.chop(1);
-    deletedFiles.append(pathNoSlash);
+    if (pathNoSlash.isEmpty())
+        deleteAll = true;
+    else
+        deletedFiles.append("D " + pathNoSlash.toUtf8() + "\n");
 }
 
 QIODevice *FastImportRepository::Transaction::addFile(const QString &path, int mode, qint64 length)
@@ -1009,15 +1445,26 @@ QIODevice *FastImportRepository::Transaction::addFile(const QString &path, int m
     // in case the two mark allocations meet, we might as well just abort
     Q_ASSERT(mark > repository->last_commit_mark + 1);
 
-    if (modifiedFiles.capacity() == 0)
-        modifiedFiles.reserve(2048);
-    modifiedFiles.append("M ");
-    modifiedFiles.append(QByteArray::number(mode, 8));
-    modifiedFiles.append(" :");
-    modifiedFiles.append(QByteArray::number(mark));
-    modifiedFiles.append(' ');
-    modifiedFiles.append(repository->prefix + path.toUtf8());
-    modifiedFiles.append("\n");
+    modifiedFiles.append("M " + QByteArray::number(mode, 8) + " :" + QByteArray::number(mark)
+                         + ' ' + (repository->prefix + path).toUtf8() + '\n');
+
+    ++blobs;
+    blobBytes += length;
+    QList<LargeBlob> &largest = repository->largestBlobs;
+    if (largest.size() < largestBlobCount || length > largest.last().size) {
+        LargeBlob blob;
+        blob.size = length;
+        blob.revnum = revnum;
+        blob.svnprefix = svnprefix;
+        blob.branch = branch;
+        blob.path = path.toUtf8();
+        int i = largest.size();
+        while (i > 0 && largest.at(i - 1).size < length)
+            --i;
+        largest.insert(i, blob);
+        if (largest.size() > largestBlobCount)
+            largest.removeLast();
+    }
 
     // it is returned for being written to, so start the process in any case
     repository->startFastImport();
@@ -1039,8 +1486,16 @@ bool FastImportRepository::Transaction::commitNote(const QByteArray &noteText, b
     {
         branchRef.prepend("refs/heads/");
     }
-    const QByteArray &commitRef = commit.isNull() ? branchRef : commit;
-    QByteArray message = "Adding Git note for current " + commitRef + "\n";
+
+    // Notes are written out in batches, by which time the branch may have
+    // moved on: refer to the commit the branch points to right now.
+    QByteArray commitRef = commit;
+    if (commit.isNull()) {
+        commitRef = branchRef;
+        QHash<QString, Branch>::ConstIterator br = repository->branches.constFind(branch);
+        if (br != repository->branches.constEnd() && !br->marks.isEmpty() && br->marks.last())
+            commitRef = ":" + QByteArray::number(br->marks.last());
+    }
     QByteArray text = noteText;
     if (noteText[noteText.size() - 1] != '\n')
     {
@@ -1063,20 +1518,19 @@ bool FastImportRepository::Transaction::commitNote(const QByteArray &noteText, b
             return false;
         }
         text = branchNote + text;
-        message = "Appending Git note for current " + commitRef + "\n";
     }
 
-    QByteArray s("");
-    s.append("commit refs/notes/commits\n");
-    s.append("mark :" + QByteArray::number(maxMark) + "\n");
-    s.append("committer " + author + " " + QString::number(datetime) + " +0000" + "\n");
-    s.append("data " + QString::number(message.length()) + "\n");
-    s.append(message + "\n");
+    ++repository->usage.notes;
+    ++repository->branchUsage[branch].notes;
+
+    // A later note for the same commit in the batch replaces the earlier
+    // one, which is fine as appended notes contain everything before them.
+    QByteArray &s = repository->pendingNotes;
     s.append("N inline " + commitRef + "\n");
-    s.append("data " + QString::number(text.length()) + "\n");
+    s.append("data " + QByteArray::number(text.length()) + "\n");
     s.append(text + "\n");
-    repository->startFastImport();
-    repository->fastImport.write(s);
+    repository->pendingNotesCommitter = author + " " + QByteArray::number(datetime) + " +0000";
+    repository->pendingNoteCount++;
 
     if (commit.isNull())
     {
@@ -1088,6 +1542,11 @@ bool FastImportRepository::Transaction::commitNote(const QByteArray &noteText, b
 
 int FastImportRepository::Transaction::commit()
 {
+    TraceSpan span("commit", branch);
+
+    qint64 buffered = modifiedFiles.memoryUsage() + deletedFiles.memoryUsage();
+    repository->largestTransaction = qMax(repository->largestTransaction, buffered);
+
     foreach (QString branchName, repository->branches.keys())
     {
         if (branchName.toUtf8().startsWith(branch + "/") || branch.startsWith((branchName + "/").toUtf8()))
@@ -1097,7 +1556,7 @@ int FastImportRepository::Transaction::commit()
         }
     }
 
-    repository->startFastImport();
+    repository->loadBranch(QString::fromUtf8(branch));
 
     // We might be tempted to use the SVN revision number as the fast-import commit mark.
     // However, a single SVN revision can modify multiple branches, and thus lead to multiple
@@ -1132,6 +1591,14 @@ int FastImportRepository::Transaction::commit()
     br.commits.append(revnum);
     br.marks.append(mark);
 
+    Usage &bu = repository->branchUsage[branch];
+    ++bu.commits;
+    bu.blobs += blobs;
+    bu.blobBytes += blobBytes;
+    ++repository->usage.commits;
+    repository->usage.blobs += blobs;
+    repository->usage.blobBytes += blobBytes;
+
     QByteArray branchRef = branch;
     if (!branchRef.startsWith("refs/"))
         branchRef.prepend("refs/heads/");
@@ -1178,30 +1645,27 @@ int FastImportRepository::Transaction::commit()
         }
     }
     // write the file deletions
-    if (deletedFiles.contains(""))
+    if (deleteAll)
         repository->fastImport.write("deleteall\n");
     else
-        foreach (QString df, deletedFiles)
-            repository->fastImport.write("D " + df.toUtf8() + "\n");
+        deletedFiles.writeTo(repository);
 
     // write the file modifications
-    repository->fastImport.write(modifiedFiles);
+    modifiedFiles.writeTo(repository);
 
     repository->fastImport.write("\nprogress SVN r" + QByteArray::number(revnum)
                                  + " branch " + branch + " = :" + QByteArray::number(mark)
                                  + (desc.isEmpty() ? "" : " # merge from") + desc
                                  + "\n\n");
-    printf(" %d modifications from SVN %s to %s/%s",
-           deletedFiles.count() + modifiedFiles.count('\n'), svnprefix.data(),
-           qPrintable(repository->name), branch.data());
+    if (CommandLineParser::instance()->contains("debug-rules"))
+        qDebug() << "r" << revnum << ":" << deleteAll + deletedFiles.lineCount() + modifiedFiles.lineCount()
+                 << "modifications from SVN" << svnprefix << "to" << repository->name + "/" + branch;
 
     // Commit metadata note if requested
     if (CommandLineParser::instance()->contains("add-metadata-notes"))
         commitNote(Repository::formatMetadataMessage(svnprefix, revnum), false);
 
-    while (repository->fastImport.bytesToWrite())
-        if (!repository->fastImport.waitForBytesWritten(-1))
-            qFatal("Failed to write to process: %s for repository %s", qPrintable(repository->fastImport.errorString()), qPrintable(repository->name));
+    repository->waitForFastImport();
 
     return EXIT_SUCCESS;
 }
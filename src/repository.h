@@ -115,6 +115,7 @@ public:
         virtual bool commitNote(const QByteArray &noteText, bool append,
                                 const QByteArray &commit = QByteArray()) = 0;
     };
+    virtual void initialize() = 0;
     virtual int setupIncremental(int &cutoff) = 0;
     virtual void restoreAnnotatedTags() = 0;
     virtual void restoreBranchNotes() = 0;
@@ -145,8 +146,14 @@ public:
 
     virtual QString getName() const = 0;
     virtual Repository *getEffectiveRepository() = 0;
+
+    // what was sent to fast-import, if --stats was given
+    virtual void printStats() const = 0;
 };
 
 Repository *createRepository(const Rules::Repository &rule, const QHash<QString, Repository *> &repositories);
+void closeFastImports();
+QByteArray fastImportStatus();
+QList<QPair<QByteArray, qint64> > repositoryMemoryUsage();
 
 #endif
@@ -19,6 +19,12 @@
 #include <QList>
 #include <QFile>
 #include <QDebug>
+#include <QHash>
+#include <QSet>
+#include <QVector>
+
+#include <limits.h>
+#include <stdio.h>
 
 #include "ruleparser.h"
 #include "CommandLineParser.h"
@@ -41,6 +47,57 @@ void RulesList::load()
         QList<Rules::Match> matchRules = rules->matchRules();
         m_allMatchRules.append( QList<Rules::Match>(matchRules));
     }
+
+    // tables can name repositories from any of the files
+    QSet<QString> names;
+    foreach (const Rules::Repository &repo, m_allrepositories)
+        names.insert(repo.name);
+    foreach (const QList<Rules::Match> &matchRules, m_allMatchRules)
+        foreach (const Rules::Match &rule, matchRules)
+            if (rule.tableParent != -1 && !names.contains(rule.repository))
+                qFatal("Table entry %s names unknown repository %s",
+                       qPrintable(rule.info()), qPrintable(rule.repository));
+}
+
+/*
+ * Lets frequently matched rules be tried before rarely matched ones,
+ * using the match counts of an earlier run. A rule only moves ahead of
+ * rules that cannot match any path it matches, so the first matching
+ * rule, and the conversion, stay the same.
+ */
+void RulesList::reorderMatchRules(const QHash<QString, qint64> &profile)
+{
+    if (profile.isEmpty())
+        return;
+
+    for (int l = 0; l < m_allMatchRules.size(); ++l) {
+        const QList<Rules::Match> rules = m_allMatchRules.at(l);
+        QList<Rules::Match> reordered;
+        QVector<qint64> counts;         // of the rules in 'reordered'
+        int moved = 0;
+
+        foreach (const Rules::Match &rule, rules) {
+            qint64 count = profile.value(rule.location());
+            int pos = reordered.size();
+            while (pos > 0 && counts.at(pos - 1) < count && rule.isDisjointFrom(reordered.at(pos - 1)))
+                --pos;
+            if (pos < reordered.size()) {
+                qDebug() << "Rule" << rule.info() << "(" << count << "matches) moved ahead of"
+                         << reordered.at(pos).location();
+                ++moved;
+            }
+            reordered.insert(pos, rule);
+            counts.insert(pos, count);
+        }
+
+        if (moved) {
+            printf("Reordered %d of %d match rules from %s, they are now tried in this order:\n",
+                   moved, rules.size(), qPrintable(rules.first().filename));
+            foreach (const Rules::Match &rule, reordered)
+                printf("  %s\n", qPrintable(rule.info()));
+        }
+        m_allMatchRules[l] = reordered;
+    }
 }
 
 const QList<Rules::Repository> RulesList::allRepositories() const
@@ -58,6 +115,55 @@ const QList<Rules*> RulesList::rules() const
   return m_rules;
 }
 
+// The text any path matched by the rule must start with, empty if unknown.
+// complete is set if the pattern is nothing but that text, so that the
+// rule matches every path starting with it.
+QString Rules::Match::literalPrefix(bool *complete) const
+{
+    const QString pattern = rx.pattern();
+    QString prefix;
+    if (complete)
+        *complete = false;
+
+    // with an alternative anywhere, the start isn't fixed
+    if (pattern.contains('|'))
+        return QString();
+
+    int i = pattern.startsWith('^') ? 1 : 0;
+    for ( ; i < pattern.length(); ++i) {
+        QChar c = pattern.at(i);
+        if (c == '\\' && i + 1 < pattern.length() && !pattern.at(i + 1).isLetterOrNumber()) {
+            prefix += pattern.at(++i);
+            continue;
+        }
+        if (QString(".[](){}*+?^$\\").contains(c))
+            break;
+        prefix += c;
+    }
+
+    // the last character may be optional or repeated zero times
+    if (i < pattern.length() && QString("?*{").contains(pattern.at(i)))
+        prefix.chop(1);
+    if (complete)
+        *complete = i == pattern.length();
+    return prefix;
+}
+
+// Whether no path can be matched by both rules at the same revision
+bool Rules::Match::isDisjointFrom(const Match &other) const
+{
+    int from = minRevision == -1 ? 0 : minRevision;
+    int to = maxRevision == -1 ? INT_MAX : maxRevision;
+    int otherFrom = other.minRevision == -1 ? 0 : other.minRevision;
+    int otherTo = other.maxRevision == -1 ? INT_MAX : other.maxRevision;
+    if (to < otherFrom || otherTo < from)
+        return true;
+
+    QString prefix = literalPrefix();
+    QString otherPrefix = other.literalPrefix();
+    return !prefix.startsWith(otherPrefix) && !otherPrefix.startsWith(prefix);
+}
+
 Rules::Rules(const QString &fn)
     : filename(fn)
 {
@@ -145,10 +251,15 @@ void Rules::load(const QString &filename)
     QRegExp declareLine("declare\\s+("+varRegex+")\\s*=\\s*(\\S+)", Qt::CaseInsensitive);
     QRegExp variableLine("\\$\\{("+varRegex+")(\\|[^}$]*)?\\}", Qt::CaseInsensitive);
     QRegExp includeLine("include\\s+(.*)", Qt::CaseInsensitive);
+    QRegExp declareTableLine("declare\\s+table\\s+("+varRegex+")", Qt::CaseInsensitive);
+    QRegExp tableEntryLine("(\\S+)\\s+repository\\s+(\\S+)(?:\\s+branch\\s+(\\S+))?(?:\\s+prefix\\s+(\\S+))?",
+                           Qt::CaseInsensitive);
+    QRegExp matchLookupLine("lookup\\s+\\\\(\\d)\\s+in\\s+("+varRegex+")", Qt::CaseInsensitive);
 
-    enum { ReadingNone, ReadingRepository, ReadingMatch } state = ReadingNone;
+    enum { ReadingNone, ReadingRepository, ReadingMatch, ReadingTable } state = ReadingNone;
     Repository repo;
     Match match;
+    QString tableName;
     int lineNumber = 0;
 
     QFile file(filename);
@@ -276,11 +387,53 @@ void Rules::load(const QString &filename)
                 } else if (matchAnnotateLine.exactMatch(line)) {
                     match.annotate = matchAnnotateLine.cap(1) == "true";
                     continue;
+                } else if (matchLookupLine.exactMatch(line)) {
+                    match.lookupCapture = matchLookupLine.cap(1).toInt();
+                    match.lookupTable = matchLookupLine.cap(2);
+                    if (match.lookupCapture < 1 || match.lookupCapture > match.rx.captureCount())
+                        qFatal("Lookup of capture %d the regular expression doesn't have on line %d",
+                               match.lookupCapture, lineNumber);
+                    if (!m_tables.contains(match.lookupTable))
+                        qFatal("Undeclared table %s on line %d", qPrintable(match.lookupTable), lineNumber);
+                    continue;
                 } else if (line == "end match") {
-                    if (!match.repository.isEmpty())
+                    if (!match.repository.isEmpty() || !match.lookupTable.isEmpty())
                         match.action = Match::Export;
+                    match.index = Stats::instance()->addRule(match);
                     m_matchRules += match;
-                    Stats::instance()->addRule(match);
+
+                    // one rule per entry, looked up instead of tried in turn
+                    foreach (const TableEntry &entry, m_tables.value(match.lookupTable)) {
+                        Match entryMatch = match;
+                        entryMatch.lookupTable.clear();
+                        entryMatch.lookupCapture = 0;
+                        entryMatch.tableKey = entry.key;
+                        entryMatch.tableParent = match.index;
+                        entryMatch.repository = entry.repository;
+                        if (!entry.branch.isEmpty())
+                            entryMatch.branch = entry.branch;
+                        if (!entry.prefix.isEmpty())
+                            entryMatch.prefix = entry.prefix;
+                        entryMatch.index = Stats::instance()->addRule(entryMatch);
+                        m_matchRules += entryMatch;
+                    }
+                    state = ReadingNone;
+                    continue;
+                }
+            } else if (state == ReadingTable) {
+                if (tableEntryLine.exactMatch(line)) {
+                    TableEntry entry;
+                    entry.filename = filename;
+                    entry.lineNumber = lineNumber;
+                    entry.key = tableEntryLine.cap(1);
+                    entry.repository = tableEntryLine.cap(2);
+                    entry.branch = tableEntryLine.cap(3);
+                    entry.prefix = tableEntryLine.cap(4);
+                    if (entry.prefix.startsWith('/'))
+                        entry.prefix = entry.prefix.mid(1);
+                    m_tables[tableName] += entry;
+                    continue;
+                } else if (line == "end table") {
                     state = ReadingNone;
                     continue;
                 }
@@ -289,8 +442,16 @@ void Rules::load(const QString &filename)
             bool isRepositoryRule = repoLine.exactMatch(line);
             bool isMatchRule = matchLine.exactMatch(line);
             bool isVariableRule = declareLine.exactMatch(line);
-
-            if (isRepositoryRule) {
+            bool isTableRule = declareTableLine.exactMatch(line);
+
+            if (isTableRule) {
+                // table of repositories for "lookup" in match rules
+                state = ReadingTable;
+                tableName = declareTableLine.cap(1);
+                if (m_tables.contains(tableName))
+                    qFatal("Table %s declared again on line %d", qPrintable(tableName), lineNumber);
+                m_tables.insert(tableName, QList<TableEntry>());
+            } else if (isRepositoryRule) {
                 // repository rule
                 state = ReadingRepository;
                 repo = Repository(); // clear
@@ -322,21 +483,42 @@ void Rules::load(const QString &filename)
 
 Stats *Stats::self = 0;
 
+// columns of the per-rule revision heatmap
+static const int heatmapColumns = 40;
+
 class Stats::Private
 {
 public:
+    struct RuleStats
+    {
+        RuleStats() : matches(0), firstRevision(-1), lastRevision(-1) {}
+        QString info;
+        QString location;
+        qint64 matches;
+        int firstRevision;
+        int lastRevision;
+        QVector<int> heat;      // matches per column of the revision range
+    };
+
     Private();
 
     void printStats() const;
-    void ruleMatched(const Rules::Match &rule, const int rev);
-    void addRule(const Rules::Match &rule);
+    bool writeProfile(const QString &fileName) const;
+    inline void ruleMatched(const Rules::Match &rule, const int rev);
+    int addRule(const Rules::Match &rule);
+    qint64 memoryUsage() const;
+
+    int firstRevision;
+    int lastRevision;
 private:
-    QMap<Rules::Match,int> m_usedRules;
+    QVector<RuleStats> m_rules;         // by Rules::Match::index
+    QHash<QString, int> m_ruleIndex;
 };
 
 Stats::Stats() : d(new Private())
 {
-    use = CommandLineParser::instance()->contains("stats");
+    use = CommandLineParser::instance()->contains("stats")
+          || CommandLineParser::instance()->contains("rule-profile");
 }
 
 Stats::~Stats()
@@ -358,7 +540,7 @@ Stats* Stats::instance()
 
 void Stats::printStats() const
 {
-    if(use)
+    if(CommandLineParser::instance()->contains("stats"))
         d->printStats();
 }
 
@@ -368,40 +550,157 @@ void Stats::ruleMatched(const Rules::Match &rule, const int rev)
         d->ruleMatched(rule, rev);
 }
 
-void Stats::addRule( const Rules::Match &rule)
+int Stats::addRule( const Rules::Match &rule)
 {
-    if(use)
-        d->addRule(rule);
+    // the index is needed even when the statistics aren't printed
+    return d->addRule(rule);
+}
+
+// Reads the match counts written by writeProfile(), by rule location
+QHash<QString, qint64> Stats::loadProfile(const QString &fileName)
+{
+    QHash<QString, qint64> profile;
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return profile;
+
+    while (!file.atEnd()) {
+        QByteArray line = file.readLine().trimmed();
+        int space = line.indexOf(' ');
+        if (space == -1)
+            continue;
+        profile.insert(QString::fromUtf8(line.mid(space + 1)), line.left(space).toLongLong());
+    }
+    return profile;
+}
+
+bool Stats::writeProfile(const QString &fileName) const
+{
+    return d->writeProfile(fileName);
+}
+
+bool Stats::Private::writeProfile(const QString &fileName) const
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "WARN: cannot write the rule profile to" << fileName << ":" << file.errorString();
+        return false;
+    }
+    foreach (const RuleStats &rule, m_rules)
+        file.write(QByteArray::number(rule.matches) + ' ' + rule.location.toUtf8() + '\n');
+    return true;
+}
+
+void Stats::setRevisionRange(int first, int last)
+{
+    d->firstRevision = first;
+    d->lastRevision = last;
+}
+
+// a rough estimate, for the memory report
+qint64 Stats::memoryUsage() const
+{
+    return d->memoryUsage();
 }
 
 Stats::Private::Private()
+    : firstRevision(0), lastRevision(-1)
 {
 }
 
+qint64 Stats::Private::memoryUsage() const
+{
+    qint64 size = m_rules.capacity() * qint64(sizeof(RuleStats));
+    foreach (const RuleStats &rule, m_rules)
+        size += rule.heat.capacity() * qint64(sizeof(int)) + rule.info.capacity() * 2;
+    return size + m_ruleIndex.size() * qint64(3 * sizeof(void *));
+}
+
+// One character per column, scaled to the busiest column of that rule
+static QByteArray heatmap(const QVector<int> &heat)
+{
+    static const char shades[] = " .:-=+*#%@";
+    int max = 0;
+    foreach (int h, heat)
+        max = qMax(max, h);
+
+    QByteArray row;
+    foreach (int h, heat)
+        row += h ? shades[1 + qint64(h) * (sizeof shades - 3) / max] : shades[0];
+    return row;
+}
+
 void Stats::Private::printStats() const
 {
+    bool showHeat = lastRevision >= firstRevision;
     printf("\nRule stats\n");
-    foreach(const Rules::Match rule, m_usedRules.keys()) {
-        printf("%s was matched %i times\n", qPrintable(rule.info()), m_usedRules[rule]);
+    if (showHeat)
+        printf("(heatmap columns span r%d to r%d)\n", firstRevision, lastRevision);
+
+    QList<const RuleStats *> dead, stopped;
+    for (int i = 0; i < m_rules.size(); ++i) {
+        const RuleStats &rule = m_rules.at(i);
+        if (!rule.matches) {
+            dead += &rule;
+            continue;
+        }
+        printf("%s was matched %lld times in r%d to r%d", qPrintable(rule.info), rule.matches,
+               rule.firstRevision, rule.lastRevision);
+        if (showHeat && !rule.heat.isEmpty())
+            printf("  |%s|", heatmap(rule.heat).constData());
+        printf("\n");
+
+        // stopped matching in the first 90% of the range
+        if (showHeat && rule.lastRevision < lastRevision - (lastRevision - firstRevision) / 10)
+            stopped += &rule;
+    }
+
+    if (!dead.isEmpty()) {
+        printf("\n%d rules were never matched\n", dead.size());
+        foreach (const RuleStats *rule, dead)
+            printf("%s\n", qPrintable(rule->info));
+    }
+    if (!stopped.isEmpty()) {
+        printf("\n%d rules stopped matching well before r%d\n", stopped.size(), lastRevision);
+        foreach (const RuleStats *rule, stopped)
+            printf("%s last matched in r%d\n", qPrintable(rule->info), rule->lastRevision);
     }
 }
 
-void Stats::Private::ruleMatched(const Rules::Match &rule, const int rev)
+inline void Stats::Private::ruleMatched(const Rules::Match &rule, const int rev)
 {
-    Q_UNUSED(rev);
-    if(!m_usedRules.contains(rule)) {
-        m_usedRules.insert(rule, 1);
+    if (rule.index < 0 || rule.index >= m_rules.size()) {
         qWarning() << "WARN: New match rule" << rule.info() << ", should have been added when created.";
-    } else {
-        m_usedRules[rule]++;
+        return;
+    }
+
+    RuleStats &stats = m_rules[rule.index];
+    ++stats.matches;
+    if (rev < 0)
+        return;
+    if (stats.firstRevision == -1 || rev < stats.firstRevision)
+        stats.firstRevision = rev;
+    stats.lastRevision = qMax(stats.lastRevision, rev);
+
+    if (lastRevision >= firstRevision && rev >= firstRevision && rev <= lastRevision) {
+        if (stats.heat.isEmpty())
+            stats.heat.fill(0, heatmapColumns);
+        ++stats.heat[qint64(rev - firstRevision) * heatmapColumns / (lastRevision - firstRevision + 1)];
     }
 }
 
-void Stats::Private::addRule( const Rules::Match &rule)
+int Stats::Private::addRule( const Rules::Match &rule)
 {
-    if(m_usedRules.contains(rule))
-        qWarning() << "WARN: Rule" << rule.info() << "was added multiple times.";
-    m_usedRules.insert(rule, 0);
+    QString info = rule.info();
+    if(m_ruleIndex.contains(info))
+        qWarning() << "WARN: Rule" << info << "was added multiple times.";
+
+    RuleStats stats;
+    stats.info = info;
+    stats.location = rule.location();
+    m_rules.append(stats);
+    m_ruleIndex.insert(info, m_rules.size() - 1);
+    return m_rules.size() - 1;
 }
 
 #ifndef QT_NO_DEBUG_STREAM
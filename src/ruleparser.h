@@ -18,6 +18,7 @@
 #ifndef RULEPARSER_H
 #define RULEPARSER_H
 
+#include <QHash>
 #include <QList>
 #include <QMap>
 #include <QRegExp>
@@ -33,6 +34,17 @@ public:
         QString filename;
         int lineNumber;
         Rule() : lineNumber(0) {}
+        const QString location() const {
+            const QString location = filename % ":" % QByteArray::number(lineNumber);
+            return location;
+        }
+    };
+    struct TableEntry : Rule
+    {
+        QString key;
+        QString repository;
+        QString branch;
+        QString prefix;
     };
     struct Repository : Rule
     {
@@ -75,6 +87,16 @@ public:
         int minRevision;
         int maxRevision;
         bool annotate;
+        int index;              // dense, in the order the rules were read
+
+        // "lookup \N in TABLE": the rule only matches if capture N is a
+        // key of TABLE, and then stands for the rule made for that entry
+        QString lookupTable;
+        int lookupCapture;
+        // set on the rules made from a table entry, which aren't tried
+        // by themselves
+        QString tableKey;
+        int tableParent;        // index of the lookup rule
 
         enum Action {
             Ignore,
@@ -82,16 +104,27 @@ public:
             Recurse
         } action;
 
-        Match() : minRevision(-1), maxRevision(-1), annotate(false), action(Ignore) { }
+        Match() : minRevision(-1), maxRevision(-1), annotate(false), index(-1),
+                  lookupCapture(0), tableParent(-1), action(Ignore) { }
         bool operator<(const Match other) const {
             if (filename != other.filename)
                 return filename < other.filename;
             return lineNumber < other.lineNumber;
         }
         const QString info() const {
-            const QString info = Rule::filename % ":" % QByteArray::number(Rule::lineNumber) % " " % rx.pattern();
+            QString info = Rule::filename % ":" % QByteArray::number(Rule::lineNumber) % " " % rx.pattern();
+            if (!tableKey.isEmpty())
+                info += " [" % tableKey % "]";
             return info;
         }
+        const QString location() const {
+            QString location = Rule::location();
+            if (!tableKey.isEmpty())
+                location += "[" % tableKey % "]";
+            return location;
+        }
+        QString literalPrefix(bool *complete = 0) const;
+        bool isDisjointFrom(const Match &other) const;
     };
 
     Rules(const QString &filename);
@@ -108,6 +141,7 @@ private:
     QList<Repository> m_repositories;
     QList<Match> m_matchRules;
     QMap<QString,QString> m_variables;
+    QHash<QString, QList<TableEntry> > m_tables;
 };
 
 class RulesList
@@ -120,6 +154,7 @@ public:
   const QList<QList<Rules::Match> > allMatchRules() const;
   const QList<Rules*> rules() const;
   void load();
+  void reorderMatchRules(const QHash<QString, qint64> &profile);
 
 private:
   QString m_filenames;
@@ -134,7 +169,11 @@ public:
     static Stats *instance();
     void printStats() const;
     void ruleMatched(const Rules::Match &rule, const int rev = -1);
-    void addRule( const Rules::Match &rule);
+    int addRule( const Rules::Match &rule);
+    void setRevisionRange(int first, int last);
+    static QHash<QString, qint64> loadProfile(const QString &fileName);
+    bool writeProfile(const QString &fileName) const;
+    qint64 memoryUsage() const;
     static void init();
     ~Stats();
 
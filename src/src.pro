@@ -27,6 +27,9 @@ target.path = $$BINDIR
 DEPENDPATH += .
 QT = core
 
+# qmake CONFIG+=usdt compiles in the static tracepoints from probes.h
+usdt: DEFINES += SVN2GIT_USDT
+
 INCLUDEPATH += . $$SVN_INCLUDE $$APR_INCLUDE
 !isEmpty(SVN_LIBDIR): LIBS += -L$$SVN_LIBDIR
 LIBS += -lsvn_fs-1 -lsvn_repos-1 -lapr-1 -lsvn_subr-1
@@ -37,8 +40,17 @@ SOURCES += ruleparser.cpp \
     svn.cpp \
     main.cpp \
     CommandLineParser.cpp \
+    progress.cpp \
+    metrics.cpp \
+    trace.cpp \
+    status.cpp \
 
 HEADERS += ruleparser.h \
     repository.h \
     svn.h \
     CommandLineParser.h \
+    probes.h \
+    progress.h \
+    metrics.h \
+    trace.h \
+    status.h \
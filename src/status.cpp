@@ -0,0 +1,227 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "status.h"
+#include "metrics.h"
+#include "repository.h"
+#include "CommandLineParser.h"
+
+#include <QDateTime>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QThread>
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// how often the conversion thread refreshes the snapshot
+static const qint64 updateInterval = 1000;
+
+Status *Status::self = 0;
+
+class StatusServer : public QThread
+{
+public:
+    StatusServer() : listener(-1), stopping(false) {}
+
+    bool listen(const QString &path);
+    void setSnapshot(const QByteArray &json);
+    void stop();
+
+protected:
+    void run();
+
+private:
+    int listener;
+    QByteArray fileName;
+
+    QMutex mutex;           // protects the two below
+    QByteArray snapshot;
+    bool stopping;
+};
+
+bool StatusServer::listen(const QString &path)
+{
+    fileName = QFile::encodeName(path);
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (fileName.size() >= int(sizeof addr.sun_path)) {
+        qWarning() << "WARN: status socket path is too long:" << path;
+        return false;
+    }
+    strcpy(addr.sun_path, fileName.constData());
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener == -1) {
+        qWarning() << "WARN: cannot create status socket:" << strerror(errno);
+        return false;
+    }
+
+    // a socket left behind by an earlier run would make bind() fail
+    unlink(fileName.constData());
+    if (bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof addr) == -1
+        || ::listen(listener, 8) == -1) {
+        qWarning() << "WARN: cannot listen on status socket" << path << ":" << strerror(errno);
+        close(listener);
+        listener = -1;
+        return false;
+    }
+    return true;
+}
+
+void StatusServer::setSnapshot(const QByteArray &json)
+{
+    QMutexLocker locker(&mutex);
+    snapshot = json;
+}
+
+void StatusServer::stop()
+{
+    {
+        QMutexLocker locker(&mutex);
+        stopping = true;
+    }
+    wait();
+    if (listener != -1) {
+        close(listener);
+        unlink(fileName.constData());
+    }
+}
+
+void StatusServer::run()
+{
+    forever {
+        {
+            QMutexLocker locker(&mutex);
+            if (stopping)
+                return;
+        }
+
+        // wake up now and then to notice stop()
+        pollfd pfd;
+        pfd.fd = listener;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 200) <= 0)
+            continue;
+
+        int client = accept(listener, 0, 0);
+        if (client == -1)
+            continue;
+
+        // don't let a client that stops reading keep us from stopping
+        timeval timeout;
+        timeout.tv_sec = 1;
+        timeout.tv_usec = 0;
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+
+        QByteArray json;
+        {
+            QMutexLocker locker(&mutex);
+            json = snapshot;
+        }
+        const char *data = json.constData();
+        qint64 left = json.size();
+        while (left > 0) {
+            ssize_t written = send(client, data, left, MSG_NOSIGNAL);
+            if (written <= 0)
+                break;
+            data += written;
+            left -= written;
+        }
+        close(client);
+    }
+}
+
+class Status::Private
+{
+public:
+    Private() : server(0), nextUpdate(0) {}
+
+    StatusServer *server;
+    QElapsedTimer clock;
+    qint64 nextUpdate;
+};
+
+Status::Status() : d(new Private)
+{
+}
+
+Status::~Status()
+{
+    stop();
+    delete d;
+}
+
+void Status::init()
+{
+    if(self)
+        delete self;
+    self = new Status();
+}
+
+Status *Status::instance()
+{
+    return self;
+}
+
+void Status::start()
+{
+    QString path = CommandLineParser::instance()->optionArgument("status-socket");
+    if (path.isEmpty() || d->server)
+        return;
+
+    d->server = new StatusServer;
+    if (!d->server->listen(path)) {
+        delete d->server;
+        d->server = 0;
+        return;
+    }
+    d->clock.start();
+    d->nextUpdate = 0;
+    update();
+    d->server->start();
+}
+
+void Status::update()
+{
+    if (!d->server || d->clock.elapsed() < d->nextUpdate)
+        return;
+    d->nextUpdate = d->clock.elapsed() + updateInterval;
+
+    QByteArray json = "{\n\"updated\": " + QByteArray::number(QDateTime::currentMSecsSinceEpoch() / 1000)
+                      + ",\n\"fast_import\": " + fastImportStatus()
+                      + ",\n\"metrics\": " + Metrics::instance()->toJson(Metrics::LiveReport)
+                      + "}\n";
+    d->server->setSnapshot(json);
+}
+
+void Status::stop()
+{
+    if (!d->server)
+        return;
+    d->server->stop();
+    delete d->server;
+    d->server = 0;
+}
@@ -0,0 +1,46 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATUS_H
+#define STATUS_H
+
+#include <QtGlobal>
+
+/**
+ * Answers every connection to the --status-socket Unix domain socket with
+ * a JSON snapshot of the conversion, then closes it. The snapshot is taken
+ * by the conversion thread at most once a second; a separate thread serves
+ * it, so a slow client never holds up the conversion. Taking it only reads
+ * counters, never walks the branches, tags or notes of the repositories.
+ */
+class Status
+{
+public:
+    static Status *instance();
+    static void init();
+    ~Status();
+
+    void start();
+    void update();
+    void stop();
+
+private:
+    Status();
+    class Private;
+    Private * const d;
+    static Status *self;
+};
+
+#endif
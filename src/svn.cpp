@@ -27,7 +27,12 @@
 
 #include "svn.h"
 #include "CommandLineParser.h"
+#include "metrics.h"
+#include "probes.h"
+#include "progress.h"
+#include "trace.h"
 
+#include <limits.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
@@ -44,8 +49,14 @@
 #include <svn_types.h>
 #include <svn_version.h>
 
+#include <QCache>
+#include <QRunnable>
+#include <QThreadPool>
 #include <QFile>
 #include <QDebug>
+#include <QSet>
+#include <QSharedPointer>
+#include <QVector>
 
 #include "repository.h"
 
@@ -56,7 +67,155 @@
 #define svn_stream_read_full svn_stream_read
 #endif
 
-typedef QList<Rules::Match> MatchRuleList;
+/*
+ * The match rules of one rules file. The list is indexed by revision:
+ * findMatchRule only tries the rules whose revision window contains the
+ * revision, and the fields it checks before the regexp are kept in a
+ * compact array of their own. The index is shared between copies and
+ * built lazily, one interval of revisions at a time. The rules expanded
+ * from a lookup table are never tried in turn: once the lookup rule
+ * matches, its capture picks the rule from a hash.
+ */
+class MatchRuleList : public QList<Rules::Match>
+{
+public:
+    struct HotFields
+    {
+        int minRevision;
+        int maxRevision;        // -1 if there is none
+        int action;
+        int lookupCapture;      // 0 unless the rule looks up a table
+        bool scanned;           // false for the rules of a table
+    };
+
+    MatchRuleList() {}
+    explicit MatchRuleList(const QList<Rules::Match> &rules);
+
+    inline const HotFields &hot(int i) const { return index->hot.at(i); }
+    const QVector<int> &activeRules(int revnum) const;
+    int lastExportRevision() const { return index->lastExportRevision; }
+    int tableRule(int i, const QString &key) const
+    { return index->tables.value(i).value(key, -1); }
+    bool mayExportUnder(int revnum, const QString &dir) const;
+
+private:
+    struct Index
+    {
+        QVector<HotFields> hot;
+        QVector<int> boundaries;        // sorted revisions where the active set changes
+        int lastExportRevision;         // INT_MAX if export rules have no max revision
+        QHash<int, QHash<QString, int> > tables;    // lookup rule -> key -> table rule
+
+        // what every path a rule matches starts with, and whether the
+        // rule matches all paths starting with it
+        QVector<QString> prefixes;
+        QVector<bool> literal;
+
+        // active rules per interval between boundaries, filled on demand
+        QHash<int, QVector<int> > active;
+        int cachedInterval;
+        const QVector<int> *cached;
+    };
+    QSharedPointer<Index> index;
+};
+
+MatchRuleList::MatchRuleList(const QList<Rules::Match> &rules)
+    : QList<Rules::Match>(rules), index(new Index)
+{
+    index->lastExportRevision = 0;
+    index->cachedInterval = -1;
+    index->cached = 0;
+
+    QHash<int, int> lookupRules;        // rule index -> position in the list
+    for (int i = 0; i < rules.size(); ++i)
+        if (!rules.at(i).lookupTable.isEmpty())
+            lookupRules.insert(rules.at(i).index, i);
+
+    QSet<int> boundaries;
+    index->hot.reserve(rules.size());
+    for (int i = 0; i < rules.size(); ++i) {
+        const Rules::Match &rule = rules.at(i);
+        HotFields hot;
+        hot.minRevision = rule.minRevision;
+        hot.maxRevision = rule.maxRevision;
+        hot.action = rule.action;
+        hot.lookupCapture = rule.lookupCapture;
+        hot.scanned = rule.tableParent == -1;
+        index->hot.append(hot);
+        if (!hot.scanned)
+            index->tables[lookupRules.value(rule.tableParent)].insert(rule.tableKey, i);
+
+        bool complete;
+        index->prefixes.append(rule.literalPrefix(&complete));
+        index->literal.append(complete);
+
+        if (rule.minRevision != -1)
+            boundaries.insert(rule.minRevision);
+        if (rule.maxRevision != -1)
+            boundaries.insert(rule.maxRevision + 1);
+        if (rule.action == Rules::Match::Export)
+            index->lastExportRevision = rule.maxRevision == -1
+                ? INT_MAX : qMax(index->lastExportRevision, rule.maxRevision);
+    }
+    index->boundaries = boundaries.toList().toVector();
+    qSort(index->boundaries);
+}
+
+const QVector<int> &MatchRuleList::activeRules(int revnum) const
+{
+    // interval i lies between boundaries i - 1 and i
+    const QVector<int> &b = index->boundaries;
+    int interval = int(qUpperBound(b.constBegin(), b.constEnd(), revnum) - b.constBegin());
+    if (interval == index->cachedInterval)
+        return *index->cached;
+
+    // revisions are mostly exported in order, so don't keep many intervals
+    if (index->active.size() > 16)
+        index->active.clear();
+
+    QHash<int, QVector<int> >::Iterator it = index->active.find(interval);
+    if (it == index->active.end()) {
+        QVector<int> active;
+        for (int i = 0; i < index->hot.size(); ++i) {
+            const HotFields &hot = index->hot.at(i);
+            if (!hot.scanned)
+                continue;
+            if (hot.minRevision > revnum)
+                continue;
+            if (hot.maxRevision != -1 && hot.maxRevision < revnum)
+                continue;
+            active.append(i);
+        }
+        it = index->active.insert(interval, active);
+    }
+    index->cachedInterval = interval;
+    index->cached = &it.value();
+    return *index->cached;
+}
+
+// Whether a path under dir, which ends in a slash, can match a rule other
+// than ignore at revnum. It answers yes when it can't tell.
+bool MatchRuleList::mayExportUnder(int revnum, const QString &dir) const
+{
+    const QVector<int> &active = activeRules(revnum);
+    for (int i = 0; i < active.size(); ++i) {
+        int rule = active.at(i);
+        const QString &prefix = index->prefixes.at(rule);
+        if (!prefix.startsWith(dir) && !dir.startsWith(prefix))
+            continue;
+
+        if (index->hot.at(rule).action != Rules::Match::Ignore)
+            return true;
+        // everything under dir is ignored before any later rule is tried
+        if (index->literal.at(rule) && dir.startsWith(prefix))
+            return false;
+    }
+    return false;
+}
+
+// changed paths in a revision from which on they're matched on all cores
+static const int parallelMatchThreshold = 1000;
+
 typedef QHash<QString, Repository *> RepositoryHash;
 typedef QHash<QByteArray, QByteArray> IdentityHash;
 
@@ -124,9 +283,20 @@ Svn::~Svn()
     delete d;
 }
 
-void Svn::setMatchRules(const QList<MatchRuleList> &allMatchRules)
+void Svn::setMatchRules(const QList<QList<Rules::Match> > &allMatchRules)
+{
+    d->allMatchRules.clear();
+    foreach (const QList<Rules::Match> &matchRules, allMatchRules)
+        d->allMatchRules.append(MatchRuleList(matchRules));
+}
+
+// No revision after this one has a rule that could export anything
+int Svn::lastExportRevision() const
 {
-    d->allMatchRules = allMatchRules;
+    int last = 0;
+    foreach (const MatchRuleList &matchRules, d->allMatchRules)
+        last = qMax(last, matchRules.lastExportRevision());
+    return last;
 }
 
 void Svn::setRepositories(const RepositoryHash &repositories)
@@ -191,29 +361,136 @@ int SvnPrivate::openRepository(const QString &pathToRepository)
 
 enum RuleType { AnyRule = 0, NoIgnoreRule = 0x01, NoRecurseRule = 0x02 };
 
-static MatchRuleList::ConstIterator
-findMatchRule(const MatchRuleList &matchRules, int revnum, const QString &current,
-              int ruleMask = AnyRule)
+struct RuleMatch
 {
-    MatchRuleList::ConstIterator it = matchRules.constBegin(),
-                                end = matchRules.constEnd();
-    for ( ; it != end; ++it) {
-        if (it->minRevision > revnum)
-            continue;
-        if (it->maxRevision != -1 && it->maxRevision < revnum)
+    int rule;               // position in the list, -1 if no rule matched
+    int lookup;             // the lookup rule that led to it, or -1
+};
+
+// The first of the active rules that matches current. The regexps in rx
+// are used if given, so that other threads can match at the same time.
+static RuleMatch firstMatchingRule(const MatchRuleList &matchRules, const QVector<int> &active,
+                                   const QString &current, int ruleMask,
+                                   const QVector<QRegExp> *rx = 0)
+{
+    RuleMatch match;
+    match.rule = -1;
+    match.lookup = -1;
+    for (int i = 0; i < active.size(); ++i) {
+        int pos = active.at(i);
+        const MatchRuleList::HotFields &hot = matchRules.hot(pos);
+        if (hot.action == Rules::Match::Ignore && ruleMask & NoIgnoreRule)
             continue;
-        if (it->action == Rules::Match::Ignore && ruleMask & NoIgnoreRule)
+        if (hot.action == Rules::Match::Recurse && ruleMask & NoRecurseRule)
             continue;
-        if (it->action == Rules::Match::Recurse && ruleMask & NoRecurseRule)
+        const QRegExp &regexp = rx ? rx->at(pos) : matchRules.at(pos).rx;
+        if (regexp.indexIn(current) != 0)
             continue;
-        if (it->rx.indexIn(current) == 0) {
-            Stats::instance()->ruleMatched(*it, revnum);
-            return it;
+        if (hot.lookupCapture) {
+            // a key missing from the table falls through to the next rules
+            int entry = matchRules.tableRule(pos, regexp.cap(hot.lookupCapture));
+            if (entry == -1)
+                continue;
+            match.lookup = pos;
+            pos = entry;
         }
+        match.rule = pos;
+        break;
     }
+    return match;
+}
+
+// Counts a match found by firstMatchingRule. splitPathName goes by the
+// state the rule's regexp was left in, so the regexp is run again unless
+// it is the one that found the match.
+static MatchRuleList::ConstIterator
+matchedRule(const MatchRuleList &matchRules, int revnum, const QString &current,
+            const RuleMatch &match, bool rematch)
+{
+    if (match.rule == -1)
+        return matchRules.constEnd();
+
+    MatchRuleList::ConstIterator it = matchRules.constBegin() + match.rule;
+    if (rematch || match.lookup != -1)
+        it->rx.indexIn(current);
+    if (match.lookup != -1)
+        Stats::instance()->ruleMatched(matchRules.at(match.lookup), revnum);
+    Stats::instance()->ruleMatched(*it, revnum);
+    SVN2GIT_PROBE3(rule__match, revnum, it->lineNumber, current.toUtf8().constData());
+    return it;
+}
 
-    // no match
-    return end;
+// Whether a rules file may send file contents for a changed path
+static bool mayDumpBlobs(const MatchRuleList &matchRules, const RuleMatch &match, bool copiedDir)
+{
+    if (match.rule == -1)
+        return copiedDir;       // auto-recursing into the copy
+    return matchRules.hot(match.rule).action != Rules::Match::Ignore;
+}
+
+static MatchRuleList::ConstIterator
+findMatchRule(const MatchRuleList &matchRules, int revnum, const QString &current,
+              int ruleMask = AnyRule)
+{
+    MetricsTimer timer(Metrics::RuleMatching);
+    RuleMatch match = firstMatchingRule(matchRules, matchRules.activeRules(revnum), current, ruleMask);
+    return matchedRule(matchRules, revnum, current, match, false);
+}
+
+/*
+ * Matches a range of the changed paths of a revision against every rules
+ * file, on a thread of the global pool. Each task matches with copies of
+ * the regexps, made before it starts: a QRegExp keeps the state of its
+ * last match.
+ */
+class MatchTask : public QRunnable
+{
+public:
+    MatchTask(const QList<MatchRuleList> &lists, const QList<const QVector<int> *> &active,
+              const QVector<QString> &paths, int begin, int end, RuleMatch *results);
+    void run();
+
+private:
+    const QList<MatchRuleList> &lists;
+    QList<const QVector<int> *> active;
+    QList<QVector<QRegExp> > rx;
+    const QVector<QString> &paths;
+    int begin;
+    int end;
+    RuleMatch *results;
+};
+
+MatchTask::MatchTask(const QList<MatchRuleList> &l, const QList<const QVector<int> *> &a,
+                     const QVector<QString> &p, int b, int e, RuleMatch *r)
+    : lists(l), active(a), paths(p), begin(b), end(e), results(r)
+{
+    foreach (const MatchRuleList &matchRules, lists) {
+        QVector<QRegExp> copies;
+        copies.reserve(matchRules.size());
+        foreach (const Rules::Match &rule, matchRules)
+            copies.append(rule.rx);
+        rx.append(copies);
+    }
+}
+
+void MatchTask::run()
+{
+    int count = lists.size();
+    for (int i = begin; i < end; ++i) {
+        if (paths.at(i).isEmpty())
+            continue;
+        for (int l = 0; l < count; ++l)
+            results[i * count + l] = firstMatchingRule(lists.at(l), *active.at(l), paths.at(i),
+                                                       AnyRule, &rx.at(l));
+    }
+}
+
+// A plain "svn propset" on an existing node: neither the contents nor the
+// history of the path changed, only its properties.
+static bool isPropertyOnlyChange(const svn_fs_path_change2_t *change, const char *path_from)
+{
+    return change->change_kind == svn_fs_path_change_modify && path_from == NULL
+        && !change->text_mod && change->prop_mod;
 }
 
 static int pathMode(svn_fs_root_t *fs_root, const char *pathname, apr_pool_t *pool)
@@ -227,11 +504,28 @@ static int pathMode(svn_fs_root_t *fs_root, const char *pathname, apr_pool_t *po
     return mode;
 }
 
+// The mode git will record for the file, see dumpBlob
+static int gitMode(svn_fs_root_t *fs_root, const char *pathname, apr_pool_t *pool)
+{
+    svn_string_t *propvalue;
+    SVN_ERR(svn_fs_node_prop(&propvalue, fs_root, pathname, "svn:special", pool));
+    if (propvalue)
+        return 0120000;
+
+    return pathMode(fs_root, pathname, pool);
+}
+
 svn_error_t *QIODevice_write(void *baton, const char *data, apr_size_t *len)
 {
     QIODevice *device = reinterpret_cast<QIODevice *>(baton);
     device->write(data, *len);
 
+    if (device->bytesToWrite() <= 32*1024)
+        return SVN_NO_ERROR;
+
+    // fast-import isn't keeping up with us
+    QElapsedTimer stall;
+    stall.start();
     while (device->bytesToWrite() > 32*1024) {
         if (!device->waitForBytesWritten(-1)) {
             qFatal("Failed to write to process: %s", qPrintable(device->errorString()));
@@ -239,6 +533,9 @@ svn_error_t *QIODevice_write(void *baton, const char *data, apr_size_t *len)
                                      qPrintable(device->errorString()));
         }
     }
+    qint64 nsecs = stall.nsecsElapsed();
+    Metrics::instance()->addStall(device->objectName(), nsecs);
+    SVN2GIT_PROBE2(fastimport__stall, qPrintable(device->objectName()), nsecs);
     return SVN_NO_ERROR;
 }
 
@@ -250,9 +547,59 @@ static svn_stream_t *streamForDevice(QIODevice *device, apr_pool_t *pool)
     return stream;
 }
 
+/*
+ * With several rules files, a file is usually exported once per rules
+ * file. The contents of the smaller ones are kept until the end of the
+ * revision, so each is read from the repository only once and the same
+ * bytes are sent to every transaction.
+ */
+class BlobCache
+{
+public:
+    struct Blob
+    {
+        int mode;
+        QByteArray data;
+    };
+    static const qint64 maxBlobSize = 1024 * 1024;
+
+    BlobCache() : cache(64 * 1024 * 1024), keep(false) {}
+
+    // Only kept while another rules file is still to export the same
+    // changed path, see SvnRevision::exportEntry
+    void clear() { cache.clear(); keep = false; }
+    void setKeep(bool k) { keep = k; }
+    bool keeps() const { return keep; }
+    const Blob *find(const char *pathname) const
+    { return cache.isEmpty() ? 0 : cache.object(QByteArray(pathname)); }
+    void insert(const char *pathname, Blob *blob) { cache.insert(QByteArray(pathname), blob, blob->data.size()); }
+
+private:
+    QCache<QByteArray, Blob> cache;
+    bool keep;
+};
+
+static BlobCache blobCache;
+
 static int dumpBlob(Repository::Transaction *txn, svn_fs_root_t *fs_root,
                     const char *pathname, const QString &finalPathName, apr_pool_t *pool)
 {
+    TraceSpan span("dumpBlob", pathname);
+
+    if (const BlobCache::Blob *blob = blobCache.find(pathname)) {
+        QIODevice *io = txn->addFile(finalPathName, blob->mode, blob->data.size());
+        Progress::instance()->fileExported(blob->data.size());
+        apr_size_t len = blob->data.size();
+        SVN_ERR(QIODevice_write(io, blob->data.constData(), &len));
+        io->putChar('\n');
+        return EXIT_SUCCESS;
+    }
+
+    // the time spent waiting for fast-import is accounted separately
+    QElapsedTimer timer;
+    timer.start();
+    qint64 stalled = Metrics::instance()->total(Metrics::FastImportWait);
+
     AprAutoPool dumppool(pool);
     // what type is it?
     int mode = pathMode(fs_root, pathname, dumppool);
@@ -260,6 +607,7 @@ static int dumpBlob(Repository::Transaction *txn, svn_fs_root_t *fs_root,
     svn_filesize_t stream_length;
 
     SVN_ERR(svn_fs_file_length(&stream_length, fs_root, pathname, dumppool));
+    SVN2GIT_PROBE2(blob__start, pathname, qint64(stream_length));
 
     svn_stream_t *in_stream, *out_stream;
     if (!CommandLineParser::instance()->contains("dry-run")) {
@@ -290,26 +638,42 @@ static int dumpBlob(Repository::Transaction *txn, svn_fs_root_t *fs_root,
     }
 
     QIODevice *io = txn->addFile(finalPathName, mode, stream_length);
+    Progress::instance()->fileExported(stream_length);
 
     if (!CommandLineParser::instance()->contains("dry-run")) {
-        // open a generic svn_stream_t for the QIODevice
-        out_stream = streamForDevice(io, dumppool);
-        SVN_ERR(svn_stream_copy3(in_stream, out_stream, NULL, NULL, dumppool));
+        if (blobCache.keeps() && stream_length <= BlobCache::maxBlobSize) {
+            QByteArray data;
+            data.resize(stream_length);
+            apr_size_t len = stream_length;
+            SVN_ERR(svn_stream_read_full(in_stream, data.data(), &len));
+            data.resize(len);
+            SVN_ERR(QIODevice_write(io, data.constData(), &len));
+
+            BlobCache::Blob *blob = new BlobCache::Blob;
+            blob->mode = mode;
+            blob->data = data;
+            blobCache.insert(pathname, blob);
+        } else {
+            // open a generic svn_stream_t for the QIODevice
+            out_stream = streamForDevice(io, dumppool);
+            SVN_ERR(svn_stream_copy3(in_stream, out_stream, NULL, NULL, dumppool));
+        }
 
         // print an ending newline
         io->putChar('\n');
     }
 
+    if (Metrics::instance()->isEnabled()) {
+        stalled = Metrics::instance()->total(Metrics::FastImportWait) - stalled;
+        Metrics::instance()->add(Metrics::BlobRead, timer.nsecsElapsed() - stalled);
+    }
+    SVN2GIT_PROBE2(blob__done, pathname, qint64(stream_length));
     return EXIT_SUCCESS;
 }
 
-static bool wasDir(svn_fs_t *fs, int revnum, const char *pathname, apr_pool_t *pool)
+static bool isDir(svn_fs_root_t *fs_root, const char *pathname, apr_pool_t *pool)
 {
     AprAutoPool subpool(pool);
-    svn_fs_root_t *fs_root;
-    if (svn_fs_revision_root(&fs_root, fs, revnum, subpool) != SVN_NO_ERROR)
-        return false;
-
     svn_boolean_t is_dir;
     if (svn_fs_is_dir(&is_dir, fs_root, pathname, subpool) != SVN_NO_ERROR)
         return false;
@@ -317,44 +681,124 @@ static bool wasDir(svn_fs_t *fs, int revnum, const char *pathname, apr_pool_t *p
     return is_dir;
 }
 
-static int recursiveDumpDir(Repository::Transaction *txn, svn_fs_t *fs, svn_fs_root_t *fs_root,
+// Opens the root of revnum, use isDir with a root that is already open
+static bool wasDir(svn_fs_t *fs, int revnum, const char *pathname, apr_pool_t *pool)
+{
+    AprAutoPool subpool(pool);
+    svn_fs_root_t *fs_root;
+    {
+        MetricsTimer timer(Metrics::OpenRoot);
+        if (svn_fs_revision_root(&fs_root, fs, revnum, subpool) != SVN_NO_ERROR)
+            return false;
+    }
+
+    return isDir(fs_root, pathname, subpool);
+}
+
+/*
+ * Lists a directory sorted by name, so we can repeat the conversions and
+ * get the same git commit hashes. Only pointers to the names in the pool
+ * are sorted, and the path of each entry is built in a buffer that is
+ * reused for every entry. The path the rules match is a new string each
+ * time: QRegExp keeps a copy of the last string it matched, for cap(),
+ * so a reused buffer would be copied on the next change anyway.
+ */
+class DirectoryWalker
+{
+public:
+    explicit DirectoryWalker(const QByteArray &dir);
+    int list(svn_fs_root_t *fs_root, apr_pool_t *pool);
+
+    int count() const { return entries.size(); }
+    const char *name(int i) const { return entries.at(i).name; }
+    svn_node_kind_t kind(int i) const { return entries.at(i).kind; }
+
+    // valid until it's called for the next entry
+    const QByteArray &path(int i);
+    QString matchPath(int i) const;
+
+private:
+    struct Entry
+    {
+        const char *name;
+        svn_node_kind_t kind;
+    };
+    static bool lessThan(const Entry &a, const Entry &b) { return strcmp(a.name, b.name) < 0; }
+
+    QByteArray dir;
+    QVector<Entry> entries;
+    QByteArray pathBuffer;
+    QString matchPrefix;
+};
+
+DirectoryWalker::DirectoryWalker(const QByteArray &d)
+    : dir(d), pathBuffer(d + '/'), matchPrefix(QString::fromUtf8(pathBuffer))
+{
+}
+
+int DirectoryWalker::list(svn_fs_root_t *fs_root, apr_pool_t *pool)
+{
+    apr_hash_t *dirents;
+    SVN_ERR(svn_fs_dir_entries(&dirents, fs_root, dir, pool));
+
+    entries.resize(0);
+    entries.reserve(apr_hash_count(dirents));
+    for (apr_hash_index_t *i = apr_hash_first(pool, dirents); i; i = apr_hash_next(i)) {
+        void *value;
+        apr_hash_this(i, NULL, NULL, &value);
+        svn_fs_dirent_t *dirent = reinterpret_cast<svn_fs_dirent_t *>(value);
+        Entry entry;
+        entry.name = dirent->name;
+        entry.kind = dirent->kind;
+        entries.append(entry);
+    }
+    qSort(entries.begin(), entries.end(), lessThan);
+    return EXIT_SUCCESS;
+}
+
+const QByteArray &DirectoryWalker::path(int i)
+{
+    pathBuffer.resize(dir.size() + 1);
+    pathBuffer.append(entries.at(i).name);
+    return pathBuffer;
+}
+
+// The path the rules are matched against, with a slash after directories
+QString DirectoryWalker::matchPath(int i) const
+{
+    QString path = matchPrefix + QString::fromUtf8(entries.at(i).name);
+    if (entries.at(i).kind == svn_node_dir)
+        path += '/';
+    return path;
+}
+
+static int recursiveDumpDir(Repository::Transaction *txn, svn_fs_root_t *fs_root,
                             const QByteArray &pathname, const QString &finalPathName,
                             apr_pool_t *pool, svn_revnum_t revnum,
                             const Rules::Match &rule, const MatchRuleList &matchRules,
                             bool ruledebug)
 {
-    if (!wasDir(fs, revnum, pathname.data(), pool)) {
+    TraceSpan span("recursiveDumpDir", pathname);
+    if (!isDir(fs_root, pathname.data(), pool)) {
         if (dumpBlob(txn, fs_root, pathname, finalPathName, pool) == EXIT_FAILURE)
             return EXIT_FAILURE;
         return EXIT_SUCCESS;
     }
 
     // get the dir listing
-    apr_hash_t *entries;
-    SVN_ERR(svn_fs_dir_entries(&entries, fs_root, pathname, pool));
+    DirectoryWalker dir(pathname);
+    if (dir.list(fs_root, pool) == EXIT_FAILURE)
+        return EXIT_FAILURE;
     AprAutoPool dirpool(pool);
 
-    // While we get a hash, put it in a map for sorted lookup, so we can
-    // repeat the conversions and get the same git commit hashes.
-    QMap<QByteArray, svn_node_kind_t> map;
-    for (apr_hash_index_t *i = apr_hash_first(pool, entries); i; i = apr_hash_next(i)) {
-        const void *vkey;
-        void *value;
-        apr_hash_this(i, &vkey, NULL, &value);
-        svn_fs_dirent_t *dirent = reinterpret_cast<svn_fs_dirent_t *>(value);
-        map.insertMulti(QByteArray(dirent->name), dirent->kind);
-    }
-
-    QMapIterator<QByteArray, svn_node_kind_t> i(map);
-    while (i.hasNext()) {
+    for (int i = 0; i < dir.count(); ++i) {
         dirpool.clear();
-        i.next();
-        QByteArray entryName = pathname + '/' + i.key();
-        QString entryFinalName = finalPathName + QString::fromUtf8(i.key());
+        const QByteArray &entryName = dir.path(i);
+        QString entryFinalName = finalPathName + QString::fromUtf8(dir.name(i));
 
-        if (i.value() == svn_node_dir) {
+        if (dir.kind(i) == svn_node_dir) {
             entryFinalName += '/';
-            QString entryNameQString = entryName + '/';
+            QString entryNameQString = dir.matchPath(i);
 
             MatchRuleList::ConstIterator match = findMatchRule(matchRules, revnum, entryNameQString);
             if (match == matchRules.constEnd()) continue; // no match of parent repo? (should not happen)
@@ -366,11 +810,9 @@ static int recursiveDumpDir(Repository::Transaction *txn, svn_fs_t *fs, svn_fs_r
                 continue;
             }
 
-            if (recursiveDumpDir(txn, fs, fs_root, entryName, entryFinalName, dirpool, revnum, rule, matchRules, ruledebug) == EXIT_FAILURE)
+            if (recursiveDumpDir(txn, fs_root, entryName, entryFinalName, dirpool, revnum, rule, matchRules, ruledebug) == EXIT_FAILURE)
                 return EXIT_FAILURE;
-        } else if (i.value() == svn_node_file) {
-            printf("+");
-            fflush(stdout);
+        } else if (dir.kind(i) == svn_node_file) {
             if (dumpBlob(txn, fs_root, entryName, entryFinalName, dirpool) == EXIT_FAILURE)
                 return EXIT_FAILURE;
         }
@@ -388,6 +830,12 @@ time_t get_epoch(const char* svn_date)
     return timegm(&tm);
 }
 
+struct ChangedPath
+{
+    const char *path;
+    svn_fs_path_change2_t *change;
+};
+
 class SvnRevision
 {
 public:
@@ -400,6 +848,7 @@ public:
 
     svn_fs_t *fs;
     svn_fs_root_t *fs_root;
+    svn_fs_root_t *prev_root;
     int revnum;
 
     // must call fetchRevProps first:
@@ -410,23 +859,48 @@ public:
     bool propsFetched;
     bool needCommit;
 
+    // for the slow revision report
+    int changedPaths;
+    int depth;
+    int maxDepth;
+
     SvnRevision(int revision, svn_fs_t *f, apr_pool_t *parent_pool)
-        : pool(parent_pool), fs(f), fs_root(0), revnum(revision), propsFetched(false)
+        : pool(parent_pool), fs(f), fs_root(0), prev_root(0), revnum(revision), propsFetched(false),
+          changedPaths(0), depth(0), maxDepth(0)
     {
         ruledebug = CommandLineParser::instance()->contains( QLatin1String("debug-rules"));
     }
 
     int open()
     {
+        MetricsTimer timer(Metrics::OpenRoot);
         SVN_ERR(svn_fs_revision_root(&fs_root, fs, revnum, pool));
         return EXIT_SUCCESS;
     }
 
+    // the root of revnum - 1, opened on first use
+    int openPrevious()
+    {
+        if (!prev_root) {
+            MetricsTimer timer(Metrics::OpenRoot);
+            SVN_ERR(svn_fs_revision_root(&prev_root, fs, revnum - 1, pool));
+        }
+        return EXIT_SUCCESS;
+    }
+
+    bool wasPreviousDir(const char *pathname, apr_pool_t *pool)
+    {
+        return openPrevious() == EXIT_SUCCESS && isDir(prev_root, pathname, pool);
+    }
+
     int prepareTransactions();
     int fetchRevProps();
     int commit();
 
-    int exportEntry(const char *path, const svn_fs_path_change2_t *change, apr_hash_t *changes);
+    void matchInParallel(const QVector<ChangedPath> &changed, QVector<QString> *paths,
+                         QVector<RuleMatch> *matches);
+    int exportEntry(const char *path, const svn_fs_path_change2_t *change, apr_hash_t *changes,
+                    const QString &matchedAs = QString(), const RuleMatch *matches = 0);
     int exportDispatch(const char *path, const svn_fs_path_change2_t *change,
                        const char *path_from, svn_revnum_t rev_from,
                        apr_hash_t *changes, const QString &current, const Rules::Match &rule,
@@ -434,6 +908,12 @@ public:
     int exportInternal(const char *path, const svn_fs_path_change2_t *change,
                        const char *path_from, svn_revnum_t rev_from,
                        const QString &current, const Rules::Match &rule, const MatchRuleList &matchRules);
+    int exportDirProperties(const char *key, const QString &current, Repository *repo,
+                            const QString &repository, const QString &branch,
+                            const QString &svnprefix, const QString &path);
+    int exportFileProperties(const char *key, const QString &current, Repository *repo,
+                             const QString &repository, const QString &branch,
+                             const QString &svnprefix, const QString &path);
     int recurse(const char *path, const svn_fs_path_change2_t *change,
                 const char *path_from, const MatchRuleList &matchRules, svn_revnum_t rev_from,
                 apr_hash_t *changes, apr_pool_t *pool);
@@ -446,8 +926,28 @@ private:
                        QString *repository_p, QString *effectiveRepository_p, QString *branch_p, QString *path_p);
 };
 
+// Opens the metrics and the probe of a revision, and closes them again
+// however exportRevision returns
+struct RevisionScope
+{
+    RevisionScope(const SvnRevision &r) : rev(r)
+    {
+        Metrics::instance()->beginRevision(rev.revnum);
+        SVN2GIT_PROBE1(revision__start, rev.revnum);
+    }
+    ~RevisionScope()
+    {
+        Metrics::instance()->endRevision(rev.changedPaths, rev.maxDepth);
+        SVN2GIT_PROBE1(revision__done, rev.revnum);
+    }
+    const SvnRevision &rev;
+};
+
 int SvnPrivate::exportRevision(int revnum)
 {
+    Trace::instance()->beginRevision(revnum);
+    TraceSpan span("exportRevision");
+
     SvnRevision rev(revnum, fs, global_pool);
     rev.allMatchRules = allMatchRules;
     rev.repositories = repositories;
@@ -455,8 +955,10 @@ int SvnPrivate::exportRevision(int revnum)
     rev.userdomain = userdomain;
 
     // open this revision:
-    printf("Exporting revision %d ", revnum);
-    fflush(stdout);
+    Progress::instance()->revisionStarted(revnum);
+    RevisionScope scope(rev);
+    if (rev.ruledebug)
+        qDebug() << "Exporting revision" << revnum;
 
     if (rev.open() == EXIT_FAILURE)
         return EXIT_FAILURE;
@@ -465,14 +967,16 @@ int SvnPrivate::exportRevision(int revnum)
         return EXIT_FAILURE;
 
     if (!rev.needCommit) {
-        printf(" nothing to do\n");
+        if (rev.ruledebug)
+            qDebug() << "revision" << revnum << "nothing to do";
+        Progress::instance()->revisionDone();
         return EXIT_SUCCESS;    // no changes?
     }
 
     if (rev.commit() == EXIT_FAILURE)
         return EXIT_FAILURE;
 
-    printf(" done\n");
+    Progress::instance()->revisionDone();
     return EXIT_SUCCESS;
 }
 
@@ -521,45 +1025,83 @@ void SvnRevision::splitPathName(const Rules::Match &rule, const QString &pathNam
     }
 }
 
+static bool changedPathLessThan(const ChangedPath &a, const ChangedPath &b)
+{
+    return strcmp(a.path, b.path) < 0;
+}
+
 int SvnRevision::prepareTransactions()
 {
     // find out what was changed in this revision:
     apr_hash_t *changes;
-    SVN_ERR(svn_fs_paths_changed2(&changes, fs_root, pool));
+    {
+        MetricsTimer timer(Metrics::PathsChanged);
+        SVN_ERR(svn_fs_paths_changed2(&changes, fs_root, pool));
+    }
+    changedPaths = apr_hash_count(changes);
 
-    QMap<QByteArray, svn_fs_path_change2_t*> map;
+    // Sort the changes by path, so we can repeat the conversions and get
+    // the same git commit hashes. Only pointers into the hash are sorted.
+    QVector<ChangedPath> sorted;
+    sorted.reserve(changedPaths);
     for (apr_hash_index_t *i = apr_hash_first(pool, changes); i; i = apr_hash_next(i)) {
         const void *vkey;
         void *value;
         apr_hash_this(i, &vkey, NULL, &value);
-        const char *key = reinterpret_cast<const char *>(vkey);
-        svn_fs_path_change2_t *change = reinterpret_cast<svn_fs_path_change2_t *>(value);
-        // If we mix path deletions with path adds/replaces we might erase a
-        // branch after that it has been reset -> history truncated
-        if (map.contains(QByteArray(key))) {
-            // If the same path is deleted and added, we need to put the
-            // deletions into the map first, then the addition.
-            if (change->change_kind == svn_fs_path_change_delete) {
-                // XXX
-            }
-            fprintf(stderr, "\nDuplicate key found in rev %d: %s\n", revnum, key);
-            fprintf(stderr, "This needs more code to be handled, file a bug report\n");
-            fflush(stderr);
-            exit(1);
-        }
-        map.insertMulti(QByteArray(key), change);
+        ChangedPath changed;
+        changed.path = reinterpret_cast<const char *>(vkey);
+        changed.change = reinterpret_cast<svn_fs_path_change2_t *>(value);
+        sorted.append(changed);
     }
-
-    QMapIterator<QByteArray, svn_fs_path_change2_t*> i(map);
-    while (i.hasNext()) {
-        i.next();
-        if (exportEntry(i.key(), i.value(), changes) == EXIT_FAILURE)
+    qSort(sorted.begin(), sorted.end(), changedPathLessThan);
+
+    // the paths of a big revision are matched on all cores first
+    QVector<QString> matchedAs;
+    QVector<RuleMatch> matches;
+    if (sorted.size() >= parallelMatchThreshold && QThreadPool::globalInstance()->maxThreadCount() > 1)
+        matchInParallel(sorted, &matchedAs, &matches);
+
+    for (int i = 0; i < sorted.size(); ++i) {
+        const RuleMatch *match = matches.isEmpty() ? 0 : matches.constData() + i * allMatchRules.size();
+        if (exportEntry(sorted.at(i).path, sorted.at(i).change, changes,
+                        matchedAs.value(i), match) == EXIT_FAILURE)
             return EXIT_FAILURE;
     }
 
     return EXIT_SUCCESS;
 }
 
+// Matches the changed paths whose kind is known against the rules at once,
+// so exportEntry only has to look up the result. The paths are matched
+// as exportEntry will: directories with a trailing slash.
+void SvnRevision::matchInParallel(const QVector<ChangedPath> &changed, QVector<QString> *paths,
+                                  QVector<RuleMatch> *matches)
+{
+    MetricsTimer timer(Metrics::RuleMatching);
+    paths->resize(changed.size());
+    for (int i = 0; i < changed.size(); ++i) {
+        svn_node_kind_t kind = changed.at(i).change->node_kind;
+        if (kind == svn_node_file)
+            (*paths)[i] = QString::fromUtf8(changed.at(i).path);
+        else if (kind == svn_node_dir)
+            (*paths)[i] = QString::fromUtf8(changed.at(i).path) + '/';
+    }
+    matches->resize(changed.size() * allMatchRules.size());
+
+    // the active rules are looked up here, the index isn't thread-safe
+    QList<const QVector<int> *> active;
+    for (int l = 0; l < allMatchRules.size(); ++l)
+        active.append(&allMatchRules.at(l).activeRules(revnum));
+
+    QThreadPool *threads = QThreadPool::globalInstance();
+    int chunk = qMax(1, changed.size() / (threads->maxThreadCount() * 4) + 1);
+    RuleMatch *results = matches->data();
+    for (int begin = 0; begin < changed.size(); begin += chunk)
+        threads->start(new MatchTask(allMatchRules, active, *paths, begin,
+                                     qMin(begin + chunk, changed.size()), results));
+    threads->waitForDone();
+}
+
 int SvnRevision::fetchRevProps()
 {
     if( propsFetched )
@@ -611,8 +1153,9 @@ int SvnRevision::commit()
 }
 
 int SvnRevision::exportEntry(const char *key, const svn_fs_path_change2_t *change,
-                             apr_hash_t *changes)
+                             apr_hash_t *changes, const QString &matchedAs, const RuleMatch *matches)
 {
+    TraceSpan span("exportEntry", key);
     AprAutoPool revpool(pool.data());
     QString current = QString::fromUtf8(key);
 
@@ -670,18 +1213,40 @@ int SvnRevision::exportEntry(const char *key, const svn_fs_path_change2_t *chang
             return EXIT_FAILURE;
         }
     } else if (change->change_kind == svn_fs_path_change_delete) {
-        is_dir = wasDir(fs, revnum - 1, key, revpool);
+        is_dir = wasPreviousDir(key, revpool);
     }
 
     if (is_dir)
         current += '/';
 
+    // find the first rule of each rules file that matches this pathname,
+    // unless that was done already
+    bool prematched = matches && current == matchedAs;
+    QVector<RuleMatch> found;
+    if (!prematched) {
+        MetricsTimer timer(Metrics::RuleMatching);
+        found.resize(allMatchRules.size());
+        for (int l = 0; l < allMatchRules.size(); ++l)
+            found[l] = firstMatchingRule(allMatchRules.at(l), allMatchRules.at(l).activeRules(revnum), current, AnyRule);
+        matches = found.constData();
+    }
+
+    // The blobs read for this path are kept for the rules files after the
+    // first that may export it too, so that they are only read once
+    int exporters = 0;
+    for (int l = 0; l < allMatchRules.size(); ++l)
+        if (mayDumpBlobs(allMatchRules.at(l), matches[l], is_dir && path_from != NULL))
+            ++exporters;
+    blobCache.clear();
+
     //MultiRule: loop start
     //Replace all returns with continue,
     bool isHandled = false;
-    foreach ( const MatchRuleList matchRules, allMatchRules ) {
-        // find the first rule that matches this pathname
-        MatchRuleList::ConstIterator match = findMatchRule(matchRules, revnum, current);
+    for (int l = 0; l < allMatchRules.size(); ++l) {
+        const MatchRuleList &matchRules = allMatchRules.at(l);
+        MatchRuleList::ConstIterator match = matchedRule(matchRules, revnum, current, matches[l], prematched);
+        if (mayDumpBlobs(matchRules, matches[l], is_dir && path_from != NULL))
+            blobCache.setKeep(--exporters > 0);
         if (match != matchRules.constEnd()) {
             const Rules::Match &rule = *match;
             if ( exportDispatch(key, change, path_from, rev_from, changes, current, rule, matchRules, revpool) == EXIT_FAILURE )
@@ -699,10 +1264,11 @@ int SvnRevision::exportEntry(const char *key, const svn_fs_path_change2_t *chang
             isHandled = true;
         }
     }
+    blobCache.clear();
     if ( isHandled ) {
         return EXIT_SUCCESS;
     }
-    if (wasDir(fs, revnum - 1, key, revpool)) {
+    if (wasPreviousDir(key, revpool)) {
         qDebug() << current << "was a directory; ignoring";
     } else if (change->change_kind == svn_fs_path_change_delete) {
         qDebug() << current << "is being deleted but I don't know anything about it; ignoring";
@@ -767,8 +1333,6 @@ int SvnRevision::exportInternal(const char *key, const svn_fs_path_change2_t *ch
         return EXIT_FAILURE;
     }
 
-    printf(".");
-    fflush(stdout);
 //                qDebug() << "   " << qPrintable(current) << "rev" << revnum << "->"
 //                         << qPrintable(repository) << qPrintable(branch) << qPrintable(path);
 
@@ -783,7 +1347,8 @@ int SvnRevision::exportInternal(const char *key, const svn_fs_path_change2_t *ch
 
     if (path_from != NULL) {
         previous = QString::fromUtf8(path_from);
-        if (wasDir(fs, rev_from, path_from, pool.data())) {
+        if (rev_from == revnum - 1 ? wasPreviousDir(path_from, pool.data())
+                                   : wasDir(fs, rev_from, path_from, pool.data())) {
             previous += '/';
         }
         MatchRuleList::ConstIterator prevmatch =
@@ -848,7 +1413,7 @@ int SvnRevision::exportInternal(const char *key, const svn_fs_path_change2_t *ch
                 if(ruledebug)
                     qDebug() << "Create a true SVN copy of branch (" << key << "->" << branch << path << ")";
                 txn->deleteFile(path);
-                recursiveDumpDir(txn, fs, fs_root, key, path, pool, revnum, rule, matchRules, ruledebug);
+                recursiveDumpDir(txn, fs_root, key, path, pool, revnum, rule, matchRules, ruledebug);
             }
             if (rule.annotate) {
                 // create an annotated tag
@@ -859,6 +1424,19 @@ int SvnRevision::exportInternal(const char *key, const svn_fs_path_change2_t *ch
             return EXIT_SUCCESS;
         }
     }
+    if (isPropertyOnlyChange(change, path_from)) {
+        int result = current.endsWith('/')
+            ? exportDirProperties(key, current, repo, repository, branch, svnprefix, path)
+            : exportFileProperties(key, current, repo, repository, branch, svnprefix, path);
+        // the tag only moves if the branch gets a commit in this revision
+        if (result == EXIT_SUCCESS && rule.annotate && transactions.contains(repository + branch)) {
+            fetchRevProps();
+            repo->createAnnotatedTag(branch, svnprefix, revnum, authorident,
+                                     epoch, log);
+        }
+        return result;
+    }
+
     Repository::Transaction *txn = transactions.value(repository + branch, 0);
     if (!txn) {
         txn = repo->newTransaction(branch, svnprefix, revnum);
@@ -928,7 +1506,7 @@ int SvnRevision::exportInternal(const char *key, const svn_fs_path_change2_t *ch
             }
         }
 
-        recursiveDumpDir(txn, fs, fs_root, key, path, pool, revnum, rule, matchRules, ruledebug);
+        recursiveDumpDir(txn, fs_root, key, path, pool, revnum, rule, matchRules, ruledebug);
     }
 
     if (rule.annotate) {
@@ -941,13 +1519,123 @@ int SvnRevision::exportInternal(const char *key, const svn_fs_path_change2_t *ch
     return EXIT_SUCCESS;
 }
 
+int SvnRevision::exportDirProperties(const char *key, const QString &current, Repository *repo,
+                                     const QString &repository, const QString &branch,
+                                     const QString &svnprefix, const QString &path)
+{
+    // Only the properties of this directory changed: nothing below it has to
+    // be exported again, at most the .gitignore generated from svn:ignore.
+    if(ruledebug)
+        qDebug() << "property change of dir (" << key << "->" << branch << path << ")";
+
+    if (CommandLineParser::instance()->contains("propcheck")) {
+        if (fetchUnknownProps(pool, key, fs_root) != EXIT_SUCCESS) {
+            qWarning() << "Error checking svn-properties (" << key << ")";
+        }
+    }
+
+    if (!CommandLineParser::instance()->contains("svn-ignore"))
+        return EXIT_SUCCESS;
+
+    // A .gitignore that is versioned in SVN always wins over the generated one
+    svn_node_kind_t kind;
+    SVN_ERR(svn_fs_check_path(&kind, fs_root, QByteArray(key) + "/.gitignore", pool));
+    if (kind != svn_node_none)
+        return EXIT_SUCCESS;
+
+    QString svnignore, prevsvnignore;
+    if (fetchIgnoreProps(&svnignore, pool, key, fs_root) != EXIT_SUCCESS
+        || openPrevious() != EXIT_SUCCESS
+        || fetchIgnoreProps(&prevsvnignore, pool, key, prev_root) != EXIT_SUCCESS) {
+        qWarning() << "Error fetching svn-properties (" << key << ")";
+        return EXIT_SUCCESS;
+    }
+    if (svnignore == prevsvnignore) {
+        if(ruledebug)
+            qDebug() << "svn:ignore of" << current << "unchanged, nothing to do";
+        return EXIT_SUCCESS;
+    }
+
+    Repository::Transaction *txn = transactions.value(repository + branch, 0);
+    if (!txn) {
+        txn = repo->newTransaction(branch, svnprefix, revnum);
+        if (!txn)
+            return EXIT_FAILURE;
+
+        transactions.insert(repository + branch, txn);
+    }
+
+    if (!svnignore.isNull()) {
+        addGitIgnore(pool, key, path, fs_root, txn, svnignore.toStdString().c_str());
+    } else if (!CommandLineParser::instance()->contains("empty-dirs")
+               || addGitIgnore(pool, key, path, fs_root, txn) != EXIT_SUCCESS) {
+        txn->deleteFile(path + ".gitignore");
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int SvnRevision::exportFileProperties(const char *key, const QString &current, Repository *repo,
+                                      const QString &repository, const QString &branch,
+                                      const QString &svnprefix, const QString &path)
+{
+    // Only the properties of this file changed. Git only cares about them
+    // as far as they change the mode, so the contents are left alone.
+    if (openPrevious() != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    int mode = gitMode(fs_root, key, pool);
+    int prevmode = gitMode(prev_root, key, pool);
+    if (mode == prevmode) {
+        if(ruledebug)
+            qDebug() << "property change of file (" << key << "->" << branch << path << "), mode unchanged";
+        return EXIT_SUCCESS;
+    }
+
+    Repository::Transaction *txn = transactions.value(repository + branch, 0);
+    if (!txn) {
+        txn = repo->newTransaction(branch, svnprefix, revnum);
+        if (!txn)
+            return EXIT_FAILURE;
+
+        transactions.insert(repository + branch, txn);
+    }
+
+    // Referring to the previous blob by its SHA-1 would need proof that
+    // this repository has it, so the rare mode change re-sends the contents
+    if(ruledebug)
+        qDebug() << "mode change of file (" << key << "->" << branch << path << ") to" << QByteArray::number(mode, 8) << ", re-exporting";
+    return dumpBlob(txn, fs_root, key, path, pool);
+}
+
+// Counts how deeply recurse() is nested while it is in scope
+struct RecursionDepth
+{
+    RecursionDepth(int &d, int &max) : depth(d) { max = qMax(max, ++depth); }
+    ~RecursionDepth() { --depth; }
+    int &depth;
+};
+
 int SvnRevision::recurse(const char *path, const svn_fs_path_change2_t *change,
                          const char *path_from, const MatchRuleList &matchRules, svn_revnum_t rev_from,
                          apr_hash_t *changes, apr_pool_t *pool)
 {
+    TraceSpan span("recurse", path);
+    RecursionDepth level(depth, maxDepth);
+
+    // don't list a directory whose entries would all be ignored
+    if (!matchRules.mayExportUnder(revnum, QString::fromUtf8(path) + '/')) {
+        if (ruledebug)
+            qDebug() << "rev" << revnum << path << "no rule exports anything below; skipped";
+        return EXIT_SUCCESS;
+    }
     svn_fs_root_t *fs_root = this->fs_root;
-    if (change->change_kind == svn_fs_path_change_delete)
-        SVN_ERR(svn_fs_revision_root(&fs_root, fs, revnum - 1, pool));
+    if (change->change_kind == svn_fs_path_change_delete) {
+        // deleted entries are listed from the previous revision
+        if (openPrevious() != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        fs_root = prev_root;
+    }
 
     // get the dir listing
     svn_node_kind_t kind;
@@ -960,30 +1648,26 @@ int SvnRevision::recurse(const char *path, const svn_fs_path_change2_t *change,
         return EXIT_SUCCESS;
     }
 
-    apr_hash_t *entries;
-    SVN_ERR(svn_fs_dir_entries(&entries, fs_root, path, pool));
+    DirectoryWalker dir(path);
+    if (dir.list(fs_root, pool) == EXIT_FAILURE)
+        return EXIT_FAILURE;
     AprAutoPool dirpool(pool);
 
-    // While we get a hash, put it in a map for sorted lookup, so we can
-    // repeat the conversions and get the same git commit hashes.
-    QMap<QByteArray, svn_node_kind_t> map;
-    for (apr_hash_index_t *i = apr_hash_first(pool, entries); i; i = apr_hash_next(i)) {
-        dirpool.clear();
-        const void *vkey;
-        void *value;
-        apr_hash_this(i, &vkey, NULL, &value);
-        svn_fs_dirent_t *dirent = reinterpret_cast<svn_fs_dirent_t *>(value);
-        map.insertMulti(QByteArray(dirent->name), dirent->kind);
+    // built in place like the entry's path
+    QByteArray entryFrom;
+    int fromLength = 0;
+    if (path_from) {
+        entryFrom = path_from + QByteArray("/");
+        fromLength = entryFrom.size();
     }
 
-    QMapIterator<QByteArray, svn_node_kind_t> i(map);
-    while (i.hasNext()) {
+    for (int i = 0; i < dir.count(); ++i) {
         dirpool.clear();
-        i.next();
-        QByteArray entry = path + QByteArray("/") + i.key();
-        QByteArray entryFrom;
-        if (path_from)
-            entryFrom = path_from + QByteArray("/") + i.key();
+        const QByteArray &entry = dir.path(i);
+        if (path_from) {
+            entryFrom.resize(fromLength);
+            entryFrom.append(dir.name(i));
+        }
 
         // check if this entry is in the changelist for this revision already
         svn_fs_path_change2_t *otherchange =
@@ -994,9 +1678,7 @@ int SvnRevision::recurse(const char *path, const svn_fs_path_change2_t *change,
             continue;
         }
 
-        QString current = QString::fromUtf8(entry);
-        if (i.value() == svn_node_dir)
-            current += '/';
+        QString current = dir.matchPath(i);
 
         // find the first rule that matches this pathname
         MatchRuleList::ConstIterator match = findMatchRule(matchRules, revnum, current);
@@ -1005,7 +1687,7 @@ int SvnRevision::recurse(const char *path, const svn_fs_path_change2_t *change,
                                rev_from, changes, current, *match, matchRules, dirpool) == EXIT_FAILURE)
                 return EXIT_FAILURE;
         } else {
-            if (i.value() == svn_node_dir) {
+            if (dir.kind(i) == svn_node_dir) {
                 qDebug() << current << "rev" << revnum
                          << "did not match any rules; auto-recursing";
                 if (recurse(entry, change, entryFrom.isNull() ? 0 : entryFrom.constData(),
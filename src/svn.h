@@ -39,6 +39,7 @@ public:
     void setIdentityDomain(const QString &identityDomain);
 
     int youngestRevision();
+    int lastExportRevision() const;
     bool exportRevision(int revnum);
 
 private:
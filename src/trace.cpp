@@ -0,0 +1,141 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+#include "metrics.h"
+#include "CommandLineParser.h"
+
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QVector>
+
+#include <stdio.h>
+
+Trace *Trace::self = 0;
+
+class Trace::Private
+{
+public:
+    struct Span
+    {
+        const char *name;
+        qint64 start;
+        qint64 duration;
+        int revnum;
+        QByteArray path;
+    };
+
+    Private() : sample(1), next(0), recorded(0) {}
+
+    QString fileName;
+    int sample;
+
+    QElapsedTimer clock;
+    QVector<Span> spans;
+    int next;
+    qint64 recorded;
+};
+
+Trace::Trace() : d(new Private), revnum(0), recording(false)
+{
+    CommandLineParser *args = CommandLineParser::instance();
+    d->fileName = args->optionArgument("trace");
+    if (d->fileName.isEmpty())
+        return;
+
+    d->sample = qMax(1, args->optionArgument("trace-sample", "1").toInt());
+    d->spans.resize(qMax(1, args->optionArgument("trace-buffer", "1000000").toInt()));
+    d->clock.start();
+}
+
+Trace::~Trace()
+{
+    delete d;
+}
+
+void Trace::init()
+{
+    if(self)
+        delete self;
+    self = new Trace();
+}
+
+Trace *Trace::instance()
+{
+    return self;
+}
+
+void Trace::beginRevision(int rev)
+{
+    revnum = rev;
+    recording = !d->fileName.isEmpty() && revnum % d->sample == 0;
+}
+
+// microseconds since the start of the run
+qint64 Trace::now() const
+{
+    return d->clock.nsecsElapsed() / 1000;
+}
+
+void Trace::record(const char *name, qint64 start, const QByteArray &path)
+{
+    // once the buffer is full the oldest span is overwritten
+    Private::Span &span = d->spans[d->next];
+    span.name = name;
+    span.start = start;
+    span.duration = now() - start;
+    span.revnum = revnum;
+    span.path = path;
+
+    if (++d->next == d->spans.size())
+        d->next = 0;
+    ++d->recorded;
+}
+
+void Trace::finish()
+{
+    if (d->fileName.isEmpty())
+        return;
+
+    QFile file(d->fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "WARN: cannot write trace to" << d->fileName << ":" << file.errorString();
+        return;
+    }
+
+    int count = int(qMin<qint64>(d->recorded, d->spans.size()));
+    int first = d->recorded > d->spans.size() ? d->next : 0;
+
+    file.write("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (int i = 0; i < count; ++i) {
+        const Private::Span &span = d->spans.at((first + i) % d->spans.size());
+        char buf[160];
+        snprintf(buf, sizeof buf,
+                 "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%lld,\"dur\":%lld,"
+                 "\"args\":{\"revision\":%d,\"path\":",
+                 i ? ",\n" : "", span.name, span.start, span.duration, span.revnum);
+        file.write(buf);
+        file.write(jsonString(QString::fromUtf8(span.path)));
+        file.write("}}");
+    }
+    file.write("\n]}\n");
+    file.close();
+
+    printf("Wrote %d trace spans to %s", count, qPrintable(d->fileName));
+    if (d->recorded > count)
+        printf(" (%lld older spans were dropped)", d->recorded - count);
+    printf("\n");
+}
@@ -0,0 +1,86 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <QByteArray>
+
+/**
+ * Records spans of work in a ring buffer and writes them out in the
+ * Chrome trace event format, to be opened in chrome://tracing or
+ * Perfetto. Only every --trace-sample'th revision is recorded, and only
+ * the most recent --trace-buffer spans are kept.
+ */
+class Trace
+{
+public:
+    static Trace *instance();
+    static void init();
+    ~Trace();
+
+    void beginRevision(int revnum);
+    bool isRecording() const { return recording; }
+    qint64 now() const;
+    void record(const char *name, qint64 start, const QByteArray &path);
+    void finish();
+
+private:
+    Trace();
+    class Private;
+    Private * const d;
+    static Trace *self;
+    int revnum;
+    bool recording;
+};
+
+/**
+ * Records the time between its construction and destruction as a span
+ * of the current revision, when that revision is being traced.
+ */
+class TraceSpan
+{
+public:
+    // the path is only copied when the span is recorded
+    inline explicit TraceSpan(const char *n, const char *p = 0)
+        : name(n), start(-1)
+    {
+        if (Trace::instance()->isRecording()) {
+            path = p;
+            start = Trace::instance()->now();
+        }
+    }
+    inline TraceSpan(const char *n, const QByteArray &p)
+        : name(n), start(-1)
+    {
+        if (Trace::instance()->isRecording()) {
+            path = p;
+            start = Trace::instance()->now();
+        }
+    }
+    inline ~TraceSpan()
+    {
+        if (start >= 0)
+            Trace::instance()->record(name, start, path);
+    }
+
+private:
+    Q_DISABLE_COPY(TraceSpan)
+    const char *name;
+    qint64 start;
+    QByteArray path;
+};
+
+#endif